@@ -5,12 +5,19 @@ License: GNU GPL-3.0
 
 #include "plugin.hpp"
 #include "util.hpp"
+#include "fastMath.hpp"
 
 #define ROW_COUNT 3
 #define MAX_CHANNELS 16
+#define BLOCK_COUNT (MAX_CHANNELS / 4)
 #define TWO_PI 6.28318530718f
 #define PI     3.14159265358f
 #define GRAVITY_VALUE_SIZE 13
+//Steps per sample each engine may run, 0 for as many as the pitch needs
+#define STEP_BUDGET_DEFAULT 16
+#define LEGACY_STEP_BUDGET 0
+//Frames a budgeted engine counts per sample at most, past this the pitch is far beyond hearing
+#define STEP_BUDGET_FRAMES_MAX 65536
 
 const float gravityValue [GRAVITY_VALUE_SIZE][2] = {
 	{0,0},
@@ -128,85 +135,113 @@ struct AstroVibe : Module {
 	};
 
 	struct Row{
-		struct Engine{
-			bool clockTriggerHigh;
+		//Engines are stored four to a block so they can be stepped together, lane li of block bi is engine bi * 4 + li
+		struct EngineBlock{
+			bool clockTriggerHigh [4];
 
-			int stepCnt;
-			unsigned int stepIndex;
+			int stepCnt [4];
+			unsigned int stepIndex [4];
 
-			float outputValue [2];
-			float internalState [2];
-			float outputHistory [2];
+			simd::float_4 outputValue [2];
+			simd::float_4 internalState [2];
+			simd::float_4 outputHistory [2];
 
-			float frameDrop;
+			simd::float_4 frameDrop;
 
-			float gv [2];
+			simd::float_4 gv [2];
 
-			float modeCycle;
-			bool engineFlip;
-			bool flavorFlip;
+			simd::float_4 modeCycle;
+			//1 where the engine is flipped, 0 where it isn't
+			simd::float_4 engineFlip;
+			simd::float_4 flavorFlip;
 
-			json_t *dataToJson() {
+			void reset() {
+				for(int li = 0; li < 4; li++){
+					clockTriggerHigh[li] = false;
+					stepCnt[li] = 0;
+					stepIndex[li] = 0;
+				}
+
+				outputValue[0] = 0;
+				outputValue[1] = 0;
+				internalState[0] = 0;
+				internalState[1] = 0;
+				outputHistory[0] = 0;
+				outputHistory[1] = 0;
+
+				frameDrop = 0;
+
+				gv[0] = 0;
+				gv[1] = 0;
+
+				modeCycle = 0;
+				engineFlip = 0;
+				flavorFlip = 0;
+			}
+
+			json_t *dataToJson(int li) {
 				json_t *engineJ = json_object();
 					
-				json_object_set_new(engineJ, "clockTriggerHigh", json_bool(clockTriggerHigh));
+				json_object_set_new(engineJ, "clockTriggerHigh", json_bool(clockTriggerHigh[li]));
 
-				json_object_set_new(engineJ, "stepCnt", json_integer(stepCnt));
-				json_object_set_new(engineJ, "stepIndex", json_integer(stepIndex));
+				json_object_set_new(engineJ, "stepCnt", json_integer(stepCnt[li]));
+				json_object_set_new(engineJ, "stepIndex", json_integer(stepIndex[li]));
 
-				json_object_set_new(engineJ, "outputValue.0", json_real(outputValue[0]));
-				json_object_set_new(engineJ, "outputValue.1", json_real(outputValue[1]));
-				json_object_set_new(engineJ, "internalState.0", json_real(internalState[0]));
-				json_object_set_new(engineJ, "internalState.1", json_real(internalState[1]));
-				json_object_set_new(engineJ, "outputHistory.0", json_real(outputHistory[0]));
-				json_object_set_new(engineJ, "outputHistory.1", json_real(outputHistory[1]));
+				json_object_set_new(engineJ, "outputValue.0", json_real(outputValue[0][li]));
+				json_object_set_new(engineJ, "outputValue.1", json_real(outputValue[1][li]));
+				json_object_set_new(engineJ, "internalState.0", json_real(internalState[0][li]));
+				json_object_set_new(engineJ, "internalState.1", json_real(internalState[1][li]));
+				json_object_set_new(engineJ, "outputHistory.0", json_real(outputHistory[0][li]));
+				json_object_set_new(engineJ, "outputHistory.1", json_real(outputHistory[1][li]));
 
-				json_object_set_new(engineJ, "frameDrop", json_real(frameDrop));
+				json_object_set_new(engineJ, "frameDrop", json_real(frameDrop[li]));
 
-				json_object_set_new(engineJ, "gv.0", json_real(gv[0]));
-				json_object_set_new(engineJ, "gv.1", json_real(gv[1]));
+				json_object_set_new(engineJ, "gv.0", json_real(gv[0][li]));
+				json_object_set_new(engineJ, "gv.1", json_real(gv[1][li]));
 
-				json_object_set_new(engineJ, "modeCycle", json_real(modeCycle));
-				json_object_set_new(engineJ, "engineFlip", json_bool(engineFlip));
-				json_object_set_new(engineJ, "flavorFlip", json_bool(flavorFlip));
+				json_object_set_new(engineJ, "modeCycle", json_real(modeCycle[li]));
+				json_object_set_new(engineJ, "engineFlip", json_bool(engineFlip[li] > 0));
+				json_object_set_new(engineJ, "flavorFlip", json_bool(flavorFlip[li] > 0));
 				return engineJ;
 			}
 
-			void dataFromJson(json_t *engineJ) {					
-				clockTriggerHigh = json_is_true(json_object_get(engineJ, "clockTriggerHigh"));
+			void dataFromJson(int li, json_t *engineJ) {					
+				clockTriggerHigh[li] = json_is_true(json_object_get(engineJ, "clockTriggerHigh"));
 
-				stepCnt = json_real_value(json_object_get(engineJ, "stepCnt"));
-				stepIndex = json_real_value(json_object_get(engineJ, "stepIndex"));
+				stepCnt[li] = json_real_value(json_object_get(engineJ, "stepCnt"));
+				stepIndex[li] = json_real_value(json_object_get(engineJ, "stepIndex"));
 
-				outputValue[0] = json_real_value(json_object_get(engineJ, "outputValue.0"));
-				outputValue[1] = json_real_value(json_object_get(engineJ, "outputValue.1"));
-				internalState[0] = json_real_value(json_object_get(engineJ, "internalState.0"));
-				internalState[1] = json_real_value(json_object_get(engineJ, "internalState.1"));
-				outputHistory[0] = json_real_value(json_object_get(engineJ, "outputHistory.0"));
-				outputHistory[1] = json_real_value(json_object_get(engineJ, "outputHistory.1"));
+				outputValue[0][li] = json_real_value(json_object_get(engineJ, "outputValue.0"));
+				outputValue[1][li] = json_real_value(json_object_get(engineJ, "outputValue.1"));
+				internalState[0][li] = json_real_value(json_object_get(engineJ, "internalState.0"));
+				internalState[1][li] = json_real_value(json_object_get(engineJ, "internalState.1"));
+				outputHistory[0][li] = json_real_value(json_object_get(engineJ, "outputHistory.0"));
+				outputHistory[1][li] = json_real_value(json_object_get(engineJ, "outputHistory.1"));
 
-				frameDrop = json_real_value(json_object_get(engineJ, "frameDrop"));
+				frameDrop[li] = json_real_value(json_object_get(engineJ, "frameDrop"));
 
-				gv[0] = json_real_value(json_object_get(engineJ, "gv.0"));
-				gv[1] = json_real_value(json_object_get(engineJ, "gv.1"));
+				gv[0][li] = json_real_value(json_object_get(engineJ, "gv.0"));
+				gv[1][li] = json_real_value(json_object_get(engineJ, "gv.1"));
 
-				modeCycle = json_real_value(json_object_get(engineJ, "modeCycle"));
-				engineFlip = json_is_true(json_object_get(engineJ, "engineFlip"));
-				flavorFlip = json_is_true(json_object_get(engineJ, "flavorFlip"));
+				modeCycle[li] = json_real_value(json_object_get(engineJ, "modeCycle"));
+				engineFlip[li] = json_is_true(json_object_get(engineJ, "engineFlip")) ? 1 : 0;
+				flavorFlip[li] = json_is_true(json_object_get(engineJ, "flavorFlip")) ? 1 : 0;
 			}
 		};
-		Engine engines [MAX_CHANNELS];
+		EngineBlock blocks [BLOCK_COUNT];
 		
 		bool resetTriggerHigh;
 		bool resetButtonHigh;
 		std::vector<int> sequence;
+		//Samples since the row last ran, it is skipped while nothing listens to it
+		int64_t idleSamples = 0;
 
 		json_t *dataToJson() {
 			json_t *rowJ = json_object();
 				
 			json_t *enginesJ = json_array();
 			for(int ei = 0; ei < MAX_CHANNELS; ei++){
-				json_array_insert_new(enginesJ, ei, engines[ei].dataToJson());
+				json_array_insert_new(enginesJ, ei, blocks[ei / 4].dataToJson(ei % 4));
 			}
 			json_object_set_new(rowJ, "engines", enginesJ);
 
@@ -226,11 +261,12 @@ struct AstroVibe : Module {
 		void dataFromJson(json_t *rowJ) {
 			json_t *enginesJ = json_object_get(rowJ, "engines");
 			for(int ei = 0; ei < MAX_CHANNELS; ei++){
-				engines[ei].dataFromJson(json_array_get(enginesJ,ei));
+				blocks[ei / 4].dataFromJson(ei % 4, json_array_get(enginesJ,ei));
 			}
 
 			resetTriggerHigh = json_is_true(json_object_get(rowJ, "resetTriggerHigh"));
 			resetButtonHigh = json_is_true(json_object_get(rowJ, "resetButtonHigh"));
+			idleSamples = 0;
 
 			sequence.clear();
 			json_t *sequenceJ = json_object_get(rowJ, "sequence");
@@ -245,6 +281,26 @@ struct AstroVibe : Module {
 
 	bool internalRoutingEnabled = true;
 
+	//Where a row reads its inputs from, NULL where nothing is connected
+	struct RoutingPlan{
+		Input* clock;
+		Input* freq;
+		//A Size CV or Spin input, or an output of an earlier LFO row
+		Port* color;
+		Port* spin;
+		//Inputs whose channel counts set the row's polyphony
+		Input* voices [2];
+		//False when nothing reads the row's outputs, directly or through a later row
+		bool needed;
+	};
+	RoutingPlan routingPlan [ROW_COUNT];
+	//What the plan was worked out for, it is rebuilt when any of it changes
+	bool plannedRouting = true;
+	Speed plannedSpeed [ROW_COUNT] = {};
+	std::atomic<bool> routingChanged {true};
+
+	int stepBudget = STEP_BUDGET_DEFAULT;
+
 	AstroVibe() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
 		configOutput(LEFT_MASTER_OUTPUT, "Left Master");
@@ -274,32 +330,16 @@ struct AstroVibe : Module {
 
 	void resetState(){		
 		for(int ri = 0; ri < ROW_COUNT; ri++){
-			for(int ei = 0; ei < MAX_CHANNELS; ei++){
-				rows[ri].engines[ei].clockTriggerHigh = false;
-				rows[ri].engines[ei].stepCnt = 0;
-				rows[ri].engines[ei].stepIndex = 0;
-				
-				rows[ri].engines[ei].outputValue[0] = 0;
-				rows[ri].engines[ei].outputValue[1] = 0;
-				rows[ri].engines[ei].internalState[0] = 0;
-				rows[ri].engines[ei].internalState[1] = 0;
-				rows[ri].engines[ei].outputHistory[0] = 0;
-				rows[ri].engines[ei].outputHistory[1] = 0;
-
-				rows[ri].engines[ei].frameDrop = 0;
-
-				rows[ri].engines[ei].gv[0] = 0;
-				rows[ri].engines[ei].gv[1] = 0;
-
-				rows[ri].engines[ei].modeCycle = 0;
-				rows[ri].engines[ei].engineFlip = false;
-				rows[ri].engines[ei].flavorFlip = false;
-			}			
+			for(int bi = 0; bi < BLOCK_COUNT; bi++){
+				rows[ri].blocks[bi].reset();
+			}
 			rows[ri].resetTriggerHigh = false;
 			rows[ri].resetButtonHigh = false;
+			rows[ri].idleSamples = 0;
 			pickNewSequence(ri);
 		}
 		internalRoutingEnabled = true;
+		stepBudget = STEP_BUDGET_DEFAULT;
 	}
 
 	void onReset(const ResetEvent& e) override {
@@ -320,6 +360,7 @@ struct AstroVibe : Module {
 		json_object_set_new(rootJ, "rows", rowsJ);
 
 		json_object_set_new(rootJ, "internalRoutingEnabled", json_bool(internalRoutingEnabled));
+		json_object_set_new(rootJ, "stepBudget", json_integer(stepBudget));
 
 		return rootJ;
 	}
@@ -331,20 +372,42 @@ struct AstroVibe : Module {
 		}
 
 		internalRoutingEnabled = json_is_true(json_object_get(rootJ, "internalRoutingEnabled"));
+
+		//Patches from before the budget ran every step
+		json_t *stepBudgetJ = json_object_get(rootJ, "stepBudget");
+		stepBudget = stepBudgetJ ? std::max((int)json_integer_value(stepBudgetJ), 0) : LEGACY_STEP_BUDGET;
 	}
 
 	void process(const ProcessArgs& args) override {
+		using simd::float_4;
+
 		Speed rowSpeed [ROW_COUNT];
+		for(int ri = 0; ri < ROW_COUNT; ri++){
+			rowSpeed[ri] = params[SPEED_SWITCH_1_PARAM + ri].getValue() > 0 ? Audible : LFO;
+		}
+
+		//Read once, the menu can change them mid sample
+		int budget = stepBudget;
+		bool routing = internalRoutingEnabled;
+
+		bool replan = (routingChanged.load(std::memory_order_relaxed) && routingChanged.exchange(false)) || routing != plannedRouting;
+		for(int ri = 0; ri < ROW_COUNT; ri++){
+			if(rowSpeed[ri] != plannedSpeed[ri]) replan = true;
+		}
+		if(replan) planRouting(routing, rowSpeed);
 
-		float masterOut [MAX_CHANNELS][2] = {0,0};
+		float_4 masterOut [BLOCK_COUNT][2];
+		for(int bi = 0; bi < BLOCK_COUNT; bi++){
+			masterOut[bi][0] = 0;
+			masterOut[bi][1] = 0;
+		}
 
 		unsigned int maxChannelsUsed = 1;
 
 		for(int ri = 0; ri < ROW_COUNT; ri++){
 
-			Speed speed = params[SPEED_SWITCH_1_PARAM + ri].getValue() > 0 ? Audible : LFO;
-
-			rowSpeed[ri] = speed;
+			Speed speed = rowSpeed[ri];
+			const RoutingPlan& plan = routingPlan[ri];
 
 			bool doTravel = false;
 			{
@@ -374,286 +437,405 @@ struct AstroVibe : Module {
 
 			float knobTones = params[FREQ_KNOB_1_PARAM + ri].getValue();
 			float knobColor = params[TIMBRE_KNOB_1_PARAM + ri].getValue();
+			bool engineSwitch = params[ENGINE_SWITCH_1_PARAM + ri].getValue() > 0;
+			bool flavorSwitch = params[FLAVOR_SWITCH_1_PARAM + ri].getValue() > 0;
+			float level = params[LEVEL_1_PARAM + ri].getValue();
 
 			int channels = 1;
-			for(int ri2 = ri; ri2 >= 0; ri2--){
-				if(inputs[CLOCK_1_INPUT + ri2].isConnected()){
-					channels = std::max(channels,inputs[CLOCK_1_INPUT + ri2].getChannels());
-					break;
-				}	
-				if(!internalRoutingEnabled) break;	
-			}
-			if(internalRoutingEnabled){
-				for(int ri2 = ri; ri2 >= 0; ri2--){
-					if(inputs[FREQ_CV_1_INPUT + ri2].isConnected()){
-						channels = std::max(channels,inputs[FREQ_CV_1_INPUT + ri2].getChannels());
-						break;
-					}		
-				}
+			for(Input* voices : plan.voices){
+				if(voices) channels = std::max(channels,voices->getChannels());
 			}
 			unsigned int engineCount = (unsigned int)channels;
 
 			maxChannelsUsed = std::max(maxChannelsUsed,engineCount);
 
-			for(unsigned int ei = 0; ei < engineCount; ei++){
+			if(!plan.needed){
+				rows[ri].idleSamples++;
+				continue;
+			}
+			int64_t idleSamples = rows[ri].idleSamples;
+			rows[ri].idleSamples = 0;
 
-				AstroVibe::Row::Engine* e = &rows[ri].engines[ei];
+			for(unsigned int bi = 0; bi * 4 < engineCount; bi++){
 
-				Mode mode = ((params[ENGINE_SWITCH_1_PARAM + ri].getValue() > 0) != e->engineFlip) ? Atomic : BlackHole;
-				Flavor flavor = ((params[FLAVOR_SWITCH_1_PARAM + ri].getValue() > 0) != e->flavorFlip) ? Notes : Tones;
+				AstroVibe::Row::EngineBlock& e = rows[ri].blocks[bi];
+				int c = bi * 4;
 
-				float freqCV = 0;
-				for(int ri2 = ri; ri2 >= 0; ri2--){
-					if(inputs[FREQ_CV_1_INPUT + ri2].isConnected()){
-						freqCV = inputs[FREQ_CV_1_INPUT + ri2].getPolyVoltage(ei);
-						break;
-					}
-					if(!internalRoutingEnabled) break;
-				}
+				//Lanes past the last engine keep their state untouched
+				float_4 used = float_4(c, c + 1, c + 2, c + 3) < (float)engineCount;
 
-				float colorCV = 0;
-				for(int ri2 = ri; ri2 >= 0; ){
-					if(inputs[TIMBRE_CV_1_INPUT + ri2].isConnected()){
-						colorCV = inputs[TIMBRE_CV_1_INPUT + ri2].getPolyVoltage(ei);
-						break;
-					}
-					if(!internalRoutingEnabled) break;
-					if(ri2 == 0) break;
-					ri2--;
-					if(rowSpeed[ri2] == LFO){
-						colorCV = outputs[LEFT_1_OUTPUT + ri2].getPolyVoltage(ei);
-						break;
-					}
-				}				
-
-				//if(flavor == Notes || mode == BlackHole){
-				if(flavor == Notes){
-					float clockValue = 0;
-					for(int ri2 = ri; ri2 >= 0; ri2--){
+				float_4 freqCV = plan.freq ? plan.freq->getPolyVoltageSimd<float_4>(c) : float_4(0.f);
+				float_4 colorCV = plan.color ? plan.color->getPolyVoltageSimd<float_4>(c) : float_4(0.f);
 
-						if(inputs[CLOCK_1_INPUT + ri2].isConnected()){
-							clockValue = inputs[CLOCK_1_INPUT + ri2].getPolyVoltage(ei);
-							break;
-						}
-						if(!internalRoutingEnabled) break;
-					}
+				//Notes where the flavor switch, flipped by flavorFlip, says so
+				float_4 notes = flavorSwitch ? e.flavorFlip <= 0 : e.flavorFlip > 0;
 
-					if(!e->clockTriggerHigh && clockValue > 2.0f){
-						e->clockTriggerHigh = true;
-						
-						e->stepCnt = 0;
-						if(flavor == Notes){
+				//if(flavor == Notes || mode == BlackHole){
+				int clockedLanes = movemask(notes & used);
+				if(clockedLanes){
+					float_4 clockValue = plan.clock ? plan.clock->getPolyVoltageSimd<float_4>(c) : float_4(0.f);
+
+					for(int li = 0; li < 4; li++){
+						if(!(clockedLanes & (1 << li))) continue;
+						if(!e.clockTriggerHigh[li] && clockValue[li] > 2.0f){
+							e.clockTriggerHigh[li] = true;
+							
 							//In smoth mode just go to the next planet with each clock
-							e->stepIndex ++;
-						}else{
-							//In cruncy mode reset to first planet on clock
-							e->stepIndex = 0;
+							e.stepCnt[li] = 0;
+							e.stepIndex[li] ++;
+						}else if(e.clockTriggerHigh[li] && clockValue[li] < 0.1f){
+							e.clockTriggerHigh[li] = false;
 						}
-					}else if(e->clockTriggerHigh && clockValue < 0.1f){
-						e->clockTriggerHigh = false;
 					}
 				}
 
 				//if(speed == LFO) frameLength *= 1000;
 
-				float tone = knobTones * pow(2,freqCV);
-				float color = clamp(knobColor + colorCV / 10.f,0.f,1.f);
+				float_4 tone = knobTones * simd::pow(2.f,freqCV);
+				float_4 color = simd::clamp(knobColor + colorCV / 10.f,0.f,1.f);
 
-				float frameLength = 10.f / tone;
+				float_4 frameLength = 10.f / tone;
 				if(speed == LFO) frameLength *= 1000;
 
-				int advanceSim = 0;
-				e->frameDrop -= 44100.f / args.sampleRate;
-				while(e->frameDrop < 0){
-					e->frameDrop += frameLength;
-					advanceSim++;
+				if(idleSamples > 0){
+					//The orbit picks up where it stopped, but the mode cycle and Tones pattern catch up on the time the row sat idle
+					double elapsed = idleSamples * (44100.0 / args.sampleRate);
+					int wakingLanes = movemask(used);
+					int notesLanes = movemask(notes);
+					for(int li = 0; li < 4; li++){
+						if(!(wakingLanes & (1 << li))) continue;
+						e.modeCycle[li] = std::fmod(e.modeCycle[li] + elapsed, 200.0);
+						if(notesLanes & (1 << li)) continue;
+						int paternRate = args.sampleRate / (10 + 4000 * color[li]);
+						paternRate /= 10;
+						//The pattern repeats every paternRate steps per planet, so only the remainder matters
+						unsigned int sequenceLength = rows[ri].sequence.size();
+						double period = (double)std::max(paternRate, 1) * sequenceLength;
+						advancePattern(e.stepCnt[li], e.stepIndex[li], paternRate, std::fmod(elapsed / frameLength[li], period), sequenceLength);
+					}
 				}
 
-				float engineShift = inputs[ENGINE_CV_1_INPUT + ri].getPolyVoltage(ei);
-				float flavorShift = inputs[FLAVOR_CV_1_INPUT + ri].getPolyVoltage(ei);
+				//Each lane steps as many times as whole frames fit, lanes that are done sit out the remaining steps
+				float_4 frames = 0;
+				e.frameDrop -= ifelse(used, float_4(44100.f / args.sampleRate), float_4(0.f));
+				if(budget > 0){
+					//Counted in one go, the loop below costs a pass per frame
+					float_4 behind = used & (e.frameDrop < 0);
+					frames = ifelse(behind, -simd::floor(e.frameDrop / frameLength), float_4(0.f));
+					e.frameDrop += frames * frameLength;
+					frames = simd::fmin(frames, float_4(STEP_BUDGET_FRAMES_MAX));
+				}else{
+					float_4 behind = used & (e.frameDrop < 0);
+					while(movemask(behind)){
+						e.frameDrop += ifelse(behind, frameLength, float_4(0.f));
+						frames += ifelse(behind, float_4(1.f), float_4(0.f));
+						behind = used & (e.frameDrop < 0);
+					}
+				}
 
-				while(advanceSim > 0){
-					advanceSim--;
+				//Past the budget each step stands in for several frames, the orbit can't go any faster but the mode cycle and pattern keep time
+				float_4 advanceSim = frames;
+				float_4 stepLength = frameLength;
+				if(budget > 0){
+					advanceSim = simd::fmin(frames, float_4(budget));
+					stepLength = ifelse(frames > advanceSim, frameLength * frames / advanceSim, frameLength);
+				}
+				int steps = 0;
+				for(int li = 0; li < 4; li++) steps = std::max(steps, (int)advanceSim[li]);
+
+				float_4 engineShift = inputs[ENGINE_CV_1_INPUT + ri].getPolyVoltageSimd<float_4>(c);
+				float_4 flavorShift = inputs[FLAVOR_CV_1_INPUT + ri].getPolyVoltageSimd<float_4>(c);
+
+				float_4 angleCos = 0;
+				float_4 angleSin = 0;
+				int paternRate [4];
+				if(steps > 0){
+					//The spin and the pattern rate only change once per sample
+					float_4 angleCV = plan.spin ? plan.spin->getPolyVoltageSimd<float_4>(c) : float_4(0.f);
+					float_4 angle = ((angleCV / 5.0f) + knobColor) * TWO_PI;
+					fastSinCos(angle, angleSin, angleCos);
+
+					for(int li = 0; li < 4; li++){
+						//int paternRate = args.sampleRate / 2000 * (1 + (1-color) * 99);
+						paternRate[li] = args.sampleRate / (10 + 4000 * color[li]);
+						//paternRate /= frameLength;
+						paternRate[li] /= 10;
+					}
+				}
 
-					e->modeCycle += frameLength;
-					while(e->modeCycle > 200) e->modeCycle -= 200;
-					float mc = e->modeCycle;
-					if(mc > 100) mc = 200 - 100;
-					mc = mc / 100.f * 5.f;
+				float_4 gvScalarBase = 0.2f + color * (1.0f - 0.2f);
 
-					e->engineFlip = mc < engineShift;
-					e->flavorFlip = mc < flavorShift;
+				//Sum of the positions stepped through, averaged into the output when a budget is set
+				float_4 stepSum [2] = {0.f, 0.f};
 
-					mode = ((params[ENGINE_SWITCH_1_PARAM + ri].getValue() > 0) != e->engineFlip) ? Atomic : BlackHole;
-					flavor = ((params[FLAVOR_SWITCH_1_PARAM + ri].getValue() > 0) != e->flavorFlip) ? Notes : Tones;
+				for(int step = 0; step < steps; step++){
+					float_4 active = advanceSim > (float)step;
 
-					if(flavor == Tones){
-						//int paternRate = args.sampleRate / 2000 * (1 + (1-color) * 99);
-						int paternRate = args.sampleRate / (10 + 4000 * color);
-						//paternRate /= frameLength;
-						paternRate /= 10;
-						e->stepCnt++;
-						if(e->stepCnt > paternRate){
-							e->stepCnt -= paternRate;
-							e->stepIndex ++;
-						}
+					e.modeCycle += ifelse(active, stepLength, float_4(0.f));
+					float_4 over = active & (e.modeCycle > 200);
+					while(movemask(over)){
+						e.modeCycle -= ifelse(over, float_4(200.f), float_4(0.f));
+						over = active & (e.modeCycle > 200);
 					}
+					float_4 mc = e.modeCycle;
+					mc = ifelse(mc > 100, float_4(200 - 100), mc);
+					mc = mc / 100.f * 5.f;
 
-					// if(flavor == Tones && e->stepIndex < rows[ri].sequence.size()){
-					// 	int paternRate = args.sampleRate / 200 * (10 + color * 90);
-					// 	paternRate /= frameLength;
-					// 	e->stepCnt++;
-					// 	if(e->stepCnt > paternRate){
-					// 		e->stepCnt -= paternRate;
-					// 		e->stepIndex ++;
-					// 	}
-					// }
-
+					e.engineFlip = ifelse(active, ifelse(mc < engineShift, float_4(1.f), float_4(0.f)), e.engineFlip);
+					e.flavorFlip = ifelse(active, ifelse(mc < flavorShift, float_4(1.f), float_4(0.f)), e.flavorFlip);
+
+					float_4 atomic = engineSwitch ? e.engineFlip <= 0 : e.engineFlip > 0;
+					notes = flavorSwitch ? e.flavorFlip <= 0 : e.flavorFlip > 0;
+
+					//Stepping through the sequence is per engine bookkeeping, done a lane at a time
+					int activeLanes = movemask(active);
+					int notesLanes = movemask(notes);
+					float x [4] = {};
+					float y [4] = {};
+					for(int li = 0; li < 4; li++){
+						if(!(activeLanes & (1 << li))) continue;
+
+						int patternFrames = 1;
+						if(frames[li] > advanceSim[li]){
+							int n = frames[li];
+							int k = advanceSim[li];
+							patternFrames = ((step + 1) * n) / k - (step * n) / k;
+						}
 
-					if(e->stepIndex >= rows[ri].sequence.size()) e->stepIndex = 0;
-					int gvIndex = rows[ri].sequence[e->stepIndex];
-					float gvNew [2];
-					{
-						float angleCV = 0;
-						for(int ri2 = ri; ri2 >= 0; ){
-							if(inputs[SPIN_1_INPUT + ri2].isConnected()){
-								angleCV = inputs[SPIN_1_INPUT + ri2].getPolyVoltage(ei);
-								break;
-							}
-							if(!internalRoutingEnabled) break;
-							if(ri2 == 0) break;
-							ri2--;
-							if(rowSpeed[ri2] == LFO){
-								angleCV = outputs[RIGHT_1_OUTPUT + ri2].getPolyVoltage(ei);
-								break;
+						if(!(notesLanes & (1 << li))){
+							if(patternFrames == 1){
+								e.stepCnt[li]++;
+								if(e.stepCnt[li] > paternRate[li]){
+									e.stepCnt[li] -= paternRate[li];
+									e.stepIndex[li] ++;
+								}
+							}else{
+								advancePattern(e.stepCnt[li], e.stepIndex[li], paternRate[li], patternFrames, rows[ri].sequence.size());
 							}
 						}
-						float angle = ((angleCV / 5.0f) + knobColor) * TWO_PI;
-						float x = gravityValue[gvIndex][0];
-						float y = gravityValue[gvIndex][1];
-						float _cos = cos(angle);
-						float _sin = sin(angle);
-						gvNew[0] = x * _cos - y * _sin;
-						gvNew[1] = x * _sin + y * _cos;
+
+						// if(flavor == Tones && e->stepIndex < rows[ri].sequence.size()){
+						// 	int paternRate = args.sampleRate / 200 * (10 + color * 90);
+						// 	paternRate /= frameLength;
+						// 	e->stepCnt++;
+						// 	if(e->stepCnt > paternRate){
+						// 		e->stepCnt -= paternRate;
+						// 		e->stepIndex ++;
+						// 	}
+						// }
+
+						if(e.stepIndex[li] >= rows[ri].sequence.size()) e.stepIndex[li] = 0;
+						int gvIndex = rows[ri].sequence[e.stepIndex[li]];
+						x[li] = gravityValue[gvIndex][0];
+						y[li] = gravityValue[gvIndex][1];
 					}
-					float gvScalar = 0.2f + color * (1.0f - 0.2f);
-					if(mode == BlackHole) gvScalar *= 0.01f;
+					float_4 gvNew [2];
+					{
+						float_4 gx = float_4::load(x);
+						float_4 gy = float_4::load(y);
+						gvNew[0] = gx * angleCos - gy * angleSin;
+						gvNew[1] = gx * angleSin + gy * angleCos;
+					}
+					float_4 gvScalar = ifelse(atomic, gvScalarBase, gvScalarBase * 0.01f);
 					for (int d = 0; d < 2; d++){
-						e->gv[d] = e->gv[d] * (1-gvScalar) + gvNew[d] * gvScalar;
-						if(!std::isfinite(e->internalState[d])) e->internalState[d] = 0;
-						if(!std::isfinite(e->outputValue[d])) e->outputValue[d] = 0;
-						if(!std::isfinite(e->outputHistory[d])) e->outputHistory[d] = 0;
+						e.gv[d] = ifelse(active, e.gv[d] * (1-gvScalar) + gvNew[d] * gvScalar, e.gv[d]);
+						e.internalState[d] = ifelse(active & ~isFinite(e.internalState[d]), float_4(0.f), e.internalState[d]);
+						e.outputValue[d] = ifelse(active & ~isFinite(e.outputValue[d]), float_4(0.f), e.outputValue[d]);
+						e.outputHistory[d] = ifelse(active & ~isFinite(e.outputHistory[d]), float_4(0.f), e.outputHistory[d]);
 					}
 
-					float g_param_a = clamp(e->gv[0] / 10.f + 0.5f,0.f,1.f);
-					float g_param_b = clamp(e->gv[1] / 10.f + 0.5f,0.f,1.f);
+					float_4 g_param_a = simd::clamp(e.gv[0] / 10.f + 0.5f,0.f,1.f);
+					float_4 g_param_b = simd::clamp(e.gv[1] / 10.f + 0.5f,0.f,1.f);
 
-					if(mode == Atomic){
-						float unkown_a = 0.4f + 0.2f * g_param_a;
-						float gravity = 0.09f + (unkown_a * g_param_b) * (3.52f - 0.09f);
-						float velocity = 0.01f + (unkown_a * (1.f-g_param_b)) * (1.52f - 0.01f);
-						float decay = 0.999f - g_param_b * 0.001f;
+					float_4 atomicLanes = active & atomic;
+					if(movemask(atomicLanes)){
+						float_4 unkown_a = 0.4f + 0.2f * g_param_a;
+						float_4 gravity = 0.09f + (unkown_a * g_param_b) * (3.52f - 0.09f);
+						float_4 velocity = 0.01f + (unkown_a * (1.f-g_param_b)) * (1.52f - 0.01f);
+						float_4 decay = 0.999f - g_param_b * 0.001f;
 						for (int d = 0; d < 2; d++){
-							float dist = e->outputValue[d] - e->gv[d];
-							if(abs(dist) > 0.01f){
-								float internalState = clamp(e->internalState[d],-1000.f,1000.f);
-								internalState -= dist * gravity;
-								internalState *= decay;
-								e->internalState[d] = internalState;
-							}
-							e->outputValue[d] += e->internalState[d] * velocity;
+							float_4 dist = e.outputValue[d] - e.gv[d];
+							float_4 internalState = simd::clamp(e.internalState[d],-1000.f,1000.f);
+							internalState -= dist * gravity;
+							internalState *= decay;
+							e.internalState[d] = ifelse(atomicLanes & (simd::abs(dist) > 0.01f), internalState, e.internalState[d]);
+							e.outputValue[d] = ifelse(atomicLanes, e.outputValue[d] + e.internalState[d] * velocity, e.outputValue[d]);
 						}
-					}else{ //mode == BlackHole
-						float unkown_a = 0.2f * g_param_a;
-						float velocity = 1.f + g_param_b * (3.3f - 1.f);
-						float turnSpeed = 0.1f + unkown_a * (0.7f - 0.1f);
-						float angle = modAngle(e->internalState[0]);
-						float flip = flavor == Notes ? 1 : -1;
-						float x = e->outputValue[0];
-						float y = e->outputValue[1];
-						x += cos(angle) * velocity;
-						y += sin(angle) * velocity;
-						x = clamp(x,-100.f,100.f);
-						y = clamp(y,-100.f,100.f);
-						float dx = e->gv[0] - x;
-						float dy = e->gv[1] - y;
-						float dSqrd = dx * dx + dy * dy;
-						float angleToG = modAngleDelta(atan2(dy,dx) - angle);
-						float target = 0;
-						if(angleToG > 0) target = PI/2.f * flip;
-						else target = -PI/2.f * flip;
-						if(dSqrd > 25.f) target *= clamp(2 - dSqrd/25.f,0.f,1.f);
-						if(dSqrd < 25.f) target *= clamp(1 + log(dSqrd/25.f),1.f,1.5f);
-						float delta = modAngleDelta(angleToG - target);
-
-						if(delta > turnSpeed) angle += turnSpeed;
-						else if(delta < -turnSpeed) angle -= turnSpeed;
-						else angle += delta;
-
-						e->outputValue[0] = x;
-						e->outputValue[1] = y;
-						e->internalState[0] = angle;
+					}
+
+					float_4 blackHoleLanes = active & ~atomic;
+					if(movemask(blackHoleLanes)){
+						float_4 unkown_a = 0.2f * g_param_a;
+						float_4 velocity = 1.f + g_param_b * (3.3f - 1.f);
+						float_4 turnSpeed = 0.1f + unkown_a * (0.7f - 0.1f);
+						float_4 angle = wrapAngle(e.internalState[0]);
+						float_4 flip = ifelse(notes, float_4(1.f), float_4(-1.f));
+						float_4 x = e.outputValue[0];
+						float_4 y = e.outputValue[1];
+						float_4 _sin, _cos;
+						fastSinCos(angle, _sin, _cos);
+						x += _cos * velocity;
+						y += _sin * velocity;
+						x = simd::clamp(x,-100.f,100.f);
+						y = simd::clamp(y,-100.f,100.f);
+						float_4 dx = e.gv[0] - x;
+						float_4 dy = e.gv[1] - y;
+						float_4 dSqrd = dx * dx + dy * dy;
+						float_4 angleToG = wrapAngleDelta(fastAtan2(dy,dx) - angle);
+						float_4 target = ifelse(angleToG > 0, float_4(PI/2.f), float_4(-PI/2.f)) * flip;
+						target *= ifelse(dSqrd > 25.f, simd::clamp(2 - dSqrd/25.f,0.f,1.f), float_4(1.f));
+						//Closer in, 1 + log(dSqrd/25) is below 1 and always clamped to [1, 1.5], so the target is left as it is
+						float_4 delta = wrapAngleDelta(angleToG - target);
+
+						angle += ifelse(delta > turnSpeed, turnSpeed, ifelse(delta < -turnSpeed, -turnSpeed, delta));
+
+						e.outputValue[0] = ifelse(blackHoleLanes, x, e.outputValue[0]);
+						e.outputValue[1] = ifelse(blackHoleLanes, y, e.outputValue[1]);
+						e.internalState[0] = ifelse(blackHoleLanes, angle, e.internalState[0]);
+					}
+
+					if(budget > 0){
+						stepSum[0] += ifelse(active, e.outputValue[0], float_4(0.f));
+						stepSum[1] += ifelse(active, e.outputValue[1], float_4(0.f));
 					}
 				}
 
 				for (int d = 0; d < 2; d++){
-					float output = e->outputValue[d];
+					float_4 output = e.outputValue[d];
 
-					//Attempt to remove DC offset
-					output -= e->gv[d];
+					//A box filter over the steps of this sample, so high pitches fold back less
+					if(budget > 0) output = ifelse(advanceSim > 1.f, stepSum[d] / advanceSim, output);
 
-					float level = params[LEVEL_1_PARAM + ri].getValue();
+					//Attempt to remove DC offset
+					output -= e.gv[d];
 
 					if(speed == Audible){
 						output /= 2.f;
-						output = clamp(output,-5.f,5.f);
+						output = simd::clamp(output,-5.f,5.f);
 						output *= level * level; //Make level exponential on audio signals to better map to decibells
-						e->outputHistory[d] = 0.99f * e->outputHistory[d] + 0.01f * output;
-						output = e->outputHistory[d];
+						e.outputHistory[d] = ifelse(used, 0.99f * e.outputHistory[d] + 0.01f * output, e.outputHistory[d]);
+						output = e.outputHistory[d];
 					}else{
-						output = clamp(output,-10.f,10.f) / 2.f + 5.0f;
+						output = simd::clamp(output,-10.f,10.f) / 2.f + 5.0f;
 						output *= level;
-						if(flavor == Notes){
-							float speed = 0.000033f * tone;
-							e->outputHistory[d] = (1.f-speed) * e->outputHistory[d] + speed * output;
-							output = e->outputHistory[d];
-						}
+						float_4 speed = 0.000033f * tone;
+						e.outputHistory[d] = ifelse(used & notes, (1.f-speed) * e.outputHistory[d] + speed * output, e.outputHistory[d]);
+						output = ifelse(notes, e.outputHistory[d], output);
 					}
 
-					if(d == 0) outputs[LEFT_1_OUTPUT + ri].setVoltage(output, ei);
-					else outputs[RIGHT_1_OUTPUT + ri].setVoltage(output, ei);
+					Output& port = outputs[(d == 0 ? LEFT_1_OUTPUT : RIGHT_1_OUTPUT) + ri];
+					port.setVoltageSimd(ifelse(used, output, port.getVoltageSimd<float_4>(c)), c);
 
 					if(speed == Audible){
-						masterOut[ei][d] += output;
+						masterOut[bi][d] += ifelse(used, output, float_4(0.f));
 					}
 				}
-
-				outputs[LEFT_1_OUTPUT + ri].setChannels(channels);
-				outputs[RIGHT_1_OUTPUT + ri].setChannels(channels);
-
 			}
+
+			outputs[LEFT_1_OUTPUT + ri].setChannels(channels);
+			outputs[RIGHT_1_OUTPUT + ri].setChannels(channels);
 			
 		}
 
 		outputs[LEFT_MASTER_OUTPUT].setChannels(maxChannelsUsed);
 		outputs[RIGHT_MASTER_OUTPUT].setChannels(maxChannelsUsed);
 
-		for(unsigned int ei = 0; ei < maxChannelsUsed; ei++){
-			outputs[LEFT_MASTER_OUTPUT].setVoltage(masterOut[ei][0],ei);
-			outputs[RIGHT_MASTER_OUTPUT].setVoltage(masterOut[ei][1],ei);
+		for(unsigned int bi = 0; bi * 4 < maxChannelsUsed; bi++){
+			int c = bi * 4;
+			float_4 used = float_4(c, c + 1, c + 2, c + 3) < (float)maxChannelsUsed;
+			for (int d = 0; d < 2; d++){
+				Output& port = outputs[d == 0 ? LEFT_MASTER_OUTPUT : RIGHT_MASTER_OUTPUT];
+				port.setVoltageSimd(ifelse(used, masterOut[bi][d], port.getVoltageSimd<float_4>(c)), c);
+			}
+		}
+	}
+
+	//Lanes that aren't finite (inf or nan) fail the comparison
+	static inline simd::float_4 isFinite(simd::float_4 x){
+		return simd::abs(x) <= std::numeric_limits<float>::max();
+	}
+
+	void onPortChange(const PortChangeEvent& e) override {
+		Module::onPortChange(e);
+
+		routingChanged = true;
+	}
+
+	/**
+	 * Works out where each row reads its inputs from.
+	 *
+	 * Unpatched inputs fall back to the rows above when internal routing is on. Size CV and Spin also pick up the
+	 * left and right outputs of the row above if it runs at LFO speed.
+	 * Rows nobody listens to are marked so process() can skip them.
+	 */
+	void planRouting(bool routing, const Speed* rowSpeed){
+		for(int ri = 0; ri < ROW_COUNT; ri++){
+			RoutingPlan& plan = routingPlan[ri];
+			plan.clock = NULL;
+			for(int ri2 = ri; ri2 >= 0; ri2--){
+				if(inputs[CLOCK_1_INPUT + ri2].isConnected()){
+					plan.clock = &inputs[CLOCK_1_INPUT + ri2];
+					break;
+				}
+				if(!routing) break;
+			}
+
+			plan.freq = NULL;
+			for(int ri2 = ri; ri2 >= 0; ri2--){
+				if(inputs[FREQ_CV_1_INPUT + ri2].isConnected()){
+					plan.freq = &inputs[FREQ_CV_1_INPUT + ri2];
+					break;
+				}
+				if(!routing) break;
+			}
+
+			plan.color = planModulation(ri, TIMBRE_CV_1_INPUT, LEFT_1_OUTPUT, routing, rowSpeed);
+			plan.spin = planModulation(ri, SPIN_1_INPUT, RIGHT_1_OUTPUT, routing, rowSpeed);
+
+			//V/oct only sets the polyphony when it can be routed
+			plan.voices[0] = plan.clock;
+			plan.voices[1] = routing ? plan.freq : NULL;
+
+			plannedSpeed[ri] = rowSpeed[ri];
 		}
+
+		//A row runs when its outputs are patched, when it is Audible and a master output is patched, or when a later row that runs reads it
+		bool master = outputs[LEFT_MASTER_OUTPUT].isConnected() || outputs[RIGHT_MASTER_OUTPUT].isConnected();
+		for(int ri = ROW_COUNT - 1; ri >= 0; ri--){
+			RoutingPlan& plan = routingPlan[ri];
+			plan.needed = outputs[LEFT_1_OUTPUT + ri].isConnected() || outputs[RIGHT_1_OUTPUT + ri].isConnected() || (master && rowSpeed[ri] == Audible);
+			for(int ri2 = ri + 1; ri2 < ROW_COUNT; ri2++){
+				if(!routingPlan[ri2].needed) continue;
+				if(routingPlan[ri2].color == &outputs[LEFT_1_OUTPUT + ri] || routingPlan[ri2].spin == &outputs[RIGHT_1_OUTPUT + ri]) plan.needed = true;
+			}
+		}
+
+		plannedRouting = routing;
 	}
 
-	inline float modAngleDelta(float angle){
-		while(angle > PI) angle -= TWO_PI;
-		while(angle < -PI) angle += TWO_PI;
-		return angle;
+	Port* planModulation(int ri, int firstInput, int firstOutput, bool routing, const Speed* rowSpeed){
+		for(int ri2 = ri; ri2 >= 0; ){
+			if(inputs[firstInput + ri2].isConnected()) return &inputs[firstInput + ri2];
+			if(!routing) break;
+			if(ri2 == 0) break;
+			ri2--;
+			if(rowSpeed[ri2] == LFO) return &outputs[firstOutput + ri2];
+		}
+		return NULL;
 	}
 
-	inline float modAngle(float angle){
-		while(angle > TWO_PI) angle -= TWO_PI;
-		while(angle < 0) angle += TWO_PI;
-		return angle;
+	//Moves a Tones pattern on by frames steps at once, as frames single steps would
+	static void advancePattern(int& stepCnt, unsigned int& stepIndex, int paternRate, int frames, unsigned int sequenceLength){
+		if(paternRate <= 0){
+			stepCnt += frames;
+			stepIndex += frames;
+		}else{
+			int total = stepCnt + frames;
+			int wraps = total > paternRate ? std::min((total - 1) / paternRate, frames) : 0;
+			stepCnt = total - wraps * paternRate;
+			stepIndex += wraps;
+		}
+		if(sequenceLength > 0) stepIndex %= sequenceLength;
 	}
 
 	void pickNewSequence(int ri){
@@ -760,6 +942,26 @@ struct AstroVibeWidget : ModuleWidget {
 		mi->module = module;
 		mi->value = false;
 		menu->addChild(mi);
+
+		menu->addChild(new MenuEntry);
+		menu->addChild(createMenuLabel("Simulation Budget"));
+
+		struct StepBudgetMenuItem : MenuItem {
+			AstroVibe* module;
+			int value;
+			void onAction(const event::Action& e) override {
+				module->stepBudget = value;
+			}
+		};
+
+		const int budgets [] = {4, 8, 16, 32, 0};
+		for(int budget : budgets){
+			StepBudgetMenuItem* bi = createMenuItem<StepBudgetMenuItem>(budget > 0 ? std::to_string(budget) + " steps per sample" : "Unlimited");
+			bi->rightText = CHECKMARK(module->stepBudget == budget);
+			bi->module = module;
+			bi->value = budget;
+			menu->addChild(bi);
+		}
 	}
 };
 
@@ -7,13 +7,28 @@ License: GNU GPL-3.0
 #include "plugin.hpp"
 #include "dsp/ringbuffer.hpp"
 #include "filters/pitchshifter.h"
+#include "filters/grainshifter.h"
 #include "util.hpp"
+#include "mappedFile.hpp"
+#include "worker.hpp"
+#include "cube.hpp"
+#include "cubeCodec.hpp"
+#include "cubeOverview.hpp"
+#include "wavFile.hpp"
+#include "readPatterns.hpp"
+#include <osdialog.h>
 #include <iostream>
 #include <fstream>
 
-#define BUFFER_COUNT 6
+//Cubes with a button, light and waveform on the panel, the rest are only reached by the read patterns
+#define PANEL_CUBE_COUNT 6
+//Cube counts that can be picked from the context menu
+#define CUBE_COUNT_MIN 2
+#define CUBE_COUNT_MAX READ_PATTERN_CUBES_MAX
+//Patches from older versions always had six cubes, as does the old single file buffers.dat format
+#define LEGACY_CUBE_COUNT 6
 
-//Note this assumes 44.1khz to achive a max cube size of 10 seconds
+//Note cross fades assume 44.1khz, cube storage is sized from the real sample rate
 #define ASSUMED_SAMPLE_RATE 44100
 
 //In Seconds
@@ -21,167 +36,138 @@ License: GNU GPL-3.0
 
 #define CROSS_FADE_AMT static_cast<int>(CROSS_FADE_SECONDS * ASSUMED_SAMPLE_RATE)
 
+//Pre-roll frames copied to the start of a new record cube, the record head writes the last frame of the pre record buffer itself
+#define PRE_ROLL_FRAMES (CROSS_FADE_AMT - 1)
+//Pre-roll frames copied each sample at least, so the copy is spread over the first samples recorded into the cube
+#define PRE_ROLL_CHUNK 64
+
 #define BUFFER_LENGTH_SECONDS_KNOB_MAX 10.f
 #define BUFFER_LENGTH_SECONDS static_cast<int>(BUFFER_LENGTH_SECONDS_KNOB_MAX + CROSS_FADE_SECONDS * 2)
-#define BUFFER_SIZE_MAX static_cast<int>((BUFFER_LENGTH_SECONDS * ASSUMED_SAMPLE_RATE) + 2)
+
+//Cube size used by the old single file buffers.dat format
+#define LEGACY_BUFFER_SIZE_MAX static_cast<int>((BUFFER_LENGTH_SECONDS * ASSUMED_SAMPLE_RATE) + 2)
 
 #define BUFFER_TAIL_PADDING 1
 
-static const int READ_PATTERN_NEG [][6] = {
-	{1,1,1,1,1,1},
-	{2,1,1,1,1,1},
-	{2,1,1,2,1,1},
-	{2,1,2,1,2,1},
-	{2,2,1,2,2,1},
-	{2,2,2,2,2,1},
-	{2,2,2,2,2,2},
-	{3,2,2,2,2,2},
-	{3,2,2,3,2,2},
-	{3,2,3,2,3,2},
-	{3,3,2,3,3,2},
-	{3,3,3,3,3,2},
-	{3,3,3,3,3,3},
-	{4,3,3,3,3,3},
-	{4,3,3,4,3,3},
-	{4,3,4,3,4,3},
-	{4,4,3,4,4,3},
-	{4,4,4,4,4,3},
-	{4,4,4,4,4,4},
-	{5,4,4,4,4,4},
-	{5,4,4,5,4,4},
-	{5,4,5,4,5,4},
-	{5,5,4,5,5,4},
-	{5,5,5,5,5,4},
-	{5,5,5,5,5,5},
+#define CUBE_FILE_MAGIC "ICEC"
+#define CUBE_FILE_VERSION 3
+//Memory mapped cube files stay uncompressed
+#define CUBE_FILE_MAPPED_VERSION 2
+
+//Version 2 cube files keep the header in the first 64 bytes, so mapped pages stay cache line aligned
+#define CUBE_FILE_DATA_OFFSET 64
+//Version 1 headers stop before encoding
+#define CUBE_FILE_V1_DATA_OFFSET 24
+
+//Written at the start of each cubeN.dat file
+//Version 1 is followed by frameCount interleaved float frames
+//Version 2 is followed, at CUBE_FILE_DATA_OFFSET, by enough whole planar cube pages to hold frameCount frames
+//Version 3 is followed, at CUBE_FILE_DATA_OFFSET, by one CubeChunkHeader and its data per page, only the first frameCount frames are stored
+struct CubeFileHeader {
+	char magic [4];
+	uint32_t version;
+	uint32_t channels;
+	uint32_t loopSize;
+	uint32_t frameCount;
+	uint32_t generation;
+	//CubeEncoding of the pages, version 2 files written before it existed have 0 (float) here
+	uint32_t encoding;
 };
 
-static const int READ_PATTERN_POS [][6] = {
-	{1,2,3,4,5,6},
-	{1,2,3,4,6,5},
-	{1,2,3,5,4,6},
-	{1,2,4,3,5,6},
-	{1,3,2,4,5,6},
-	{1,2,3,5,6,4},
-	{1,2,3,6,4,5},
-	{1,2,3,6,5,4},
-	{1,2,4,3,6,5},
-	{1,2,4,5,3,6},
-	{1,2,5,3,4,6},
-	{1,2,5,4,3,6},
-	{1,3,2,4,6,5},
-	{1,3,2,5,4,6},
-	{1,3,4,2,5,6},
-	{1,4,2,3,5,6},
-	{1,4,3,2,5,6},
-	{1,2,4,5,6,3},
-	{1,2,4,6,3,5},
-	{1,2,4,6,5,3},
-	{1,2,5,3,6,4},
-	{1,2,5,4,6,3},
-	{1,2,6,3,4,5},
-	{1,2,6,3,5,4},
-	{1,2,6,4,3,5},
-	{1,2,6,4,5,3},
-	{1,3,2,5,6,4},
-	{1,3,2,6,4,5},
-	{1,3,2,6,5,4},
-	{1,3,4,2,6,5},
-	{1,3,4,5,2,6},
-	{1,3,5,2,4,6},
-	{1,3,5,4,2,6},
-	{1,4,2,3,6,5},
-	{1,4,2,5,3,6},
-	{1,4,3,2,6,5},
-	{1,4,3,5,2,6},
-	{1,5,2,3,4,6},
-	{1,5,2,4,3,6},
-	{1,5,3,2,4,6},
-	{1,5,3,4,2,6},
-	{1,2,5,6,3,4},
-	{1,2,5,6,4,3},
-	{1,2,6,5,3,4},
-	{1,2,6,5,4,3},
-	{1,3,4,5,6,2},
-	{1,3,4,6,2,5},
-	{1,3,4,6,5,2},
-	{1,3,5,2,6,4},
-	{1,3,5,4,6,2},
-	{1,3,6,2,4,5},
-	{1,3,6,2,5,4},
-	{1,3,6,4,2,5},
-	{1,3,6,4,5,2},
-	{1,4,2,5,6,3},
-	{1,4,2,6,3,5},
-	{1,4,2,6,5,3},
-	{1,4,3,5,6,2},
-	{1,4,3,6,2,5},
-	{1,4,3,6,5,2},
-	{1,4,5,2,3,6},
-	{1,4,5,3,2,6},
-	{1,5,2,3,6,4},
-	{1,5,2,4,6,3},
-	{1,5,3,2,6,4},
-	{1,5,3,4,6,2},
-	{1,5,4,2,3,6},
-	{1,5,4,3,2,6},
-	{1,6,2,3,4,5},
-	{1,6,2,3,5,4},
-	{1,6,2,4,3,5},
-	{1,6,2,4,5,3},
-	{1,6,3,2,4,5},
-	{1,6,3,2,5,4},
-	{1,6,3,4,2,5},
-	{1,6,3,4,5,2},
-	{1,3,5,6,2,4},
-	{1,3,5,6,4,2},
-	{1,3,6,5,2,4},
-	{1,3,6,5,4,2},
-	{1,4,5,2,6,3},
-	{1,4,5,3,6,2},
-	{1,4,6,2,3,5},
-	{1,4,6,2,5,3},
-	{1,4,6,3,2,5},
-	{1,4,6,3,5,2},
-	{1,5,2,6,3,4},
-	{1,5,2,6,4,3},
-	{1,5,3,6,2,4},
-	{1,5,3,6,4,2},
-	{1,5,4,2,6,3},
-	{1,5,4,3,6,2},
-	{1,6,2,5,3,4},
-	{1,6,2,5,4,3},
-	{1,6,3,5,2,4},
-	{1,6,3,5,4,2},
-	{1,6,4,2,3,5},
-	{1,6,4,2,5,3},
-	{1,6,4,3,2,5},
-	{1,6,4,3,5,2},
-	{1,4,5,6,2,3},
-	{1,4,5,6,3,2},
-	{1,4,6,5,2,3},
-	{1,4,6,5,3,2},
-	{1,5,4,6,2,3},
-	{1,5,4,6,3,2},
-	{1,5,6,2,3,4},
-	{1,5,6,2,4,3},
-	{1,5,6,3,2,4},
-	{1,5,6,3,4,2},
-	{1,5,6,4,2,3},
-	{1,5,6,4,3,2},
-	{1,6,4,5,2,3},
-	{1,6,4,5,3,2},
-	{1,6,5,2,3,4},
-	{1,6,5,2,4,3},
-	{1,6,5,3,2,4},
-	{1,6,5,3,4,2},
-	{1,6,5,4,2,3},
-	{1,6,5,4,3,2},
+enum CubeChunkType {
+	CUBE_CHUNK_SILENT,
+	//A whole page in the file's encoding
+	CUBE_CHUNK_RAW,
+	//The page's valid frames coded by CubeCodec
+	CUBE_CHUNK_CODED,
 };
 
+//Chunks can't be larger than a raw float_4 page
+#define CUBE_CHUNK_SIZE_MAX (CUBE_PAGE_FRAMES * MAX_CHANNELS * 4 * sizeof(float))
+
+struct CubeChunkHeader {
+	uint8_t type;
+	uint32_t size;
+} __attribute__((packed));
+
+//How cube files are compressed when they are saved
+enum CubeCompression {
+	CUBE_COMPRESSION_LOSSLESS,
+	//Saves 16-bit pages whatever the cubes are stored as
+	CUBE_COMPRESSION_LOSSY,
+};
+
+//Plugin wide settings, shared by every IceTray
+#define PLUGIN_SETTINGS_FILE "PathSet.json"
+
+//Reads the cube memory limit, once per run
+static void loadCubeBudgetSettings(){
+	static bool loaded = false;
+	if(loaded) return;
+	loaded = true;
+	json_error_t error;
+	json_t* rootJ = json_load_file(asset::user(PLUGIN_SETTINGS_FILE).c_str(), 0, &error);
+	if(!rootJ) return;
+	int64_t megabytes = json_integer_value(json_object_get(rootJ, "cubeMemoryLimitMB"));
+	cubeBudget().limit = std::max<int64_t>(0, megabytes) << 20;
+	json_decref(rootJ);
+}
+
+static void saveCubeBudgetSettings(){
+	std::string path = asset::user(PLUGIN_SETTINGS_FILE);
+	json_error_t error;
+	json_t* rootJ = json_load_file(path.c_str(), 0, &error);
+	if(!rootJ) rootJ = json_object();
+	json_object_set_new(rootJ, "cubeMemoryLimitMB", json_integer(cubeBudget().limit >> 20));
+	if(json_dump_file(rootJ, path.c_str(), JSON_INDENT(2)) != 0) DEBUG("Unable to write '%s'",path.c_str());
+	json_decref(rootJ);
+}
+
+//Exported and imported WAV files are streamed this many frames at a time
+#define WAV_CHUNK_FRAMES 4096
+//Voltage of a full scale WAV sample, exports are float so louder audio isn't clipped
+#define WAV_VOLTAGE 5.f
+
 #define PITCH_BUFF_SIZE 1024
 
+//Grain length of the time domain pitch correction, it delays by half of this on average
+#define GRAIN_SECONDS 0.015f
+
 #define MAX_CHANNELS 2
 
+//Voices in polyphonic mode, processed four at a time as float_4 groups
+#define POLY_CHANNELS 16
+#define POLY_GROUPS (POLY_CHANNELS / 4)
+
+//Outgoing playheads that can fade out at once, when a jump finds them all busy the quietest is cut short
+#define FADE_VOICES 8
+
+//A point in time copy of one cube, written to disk by the worker thread
+//The copy shares pages with the cube, so recording after it was taken never changes it
+//onSave builds the paths and header and reserves the page tables, the audio thread only shares pages into it
+struct CubeSnapshot {
+	//Set when the cube file needs writing
+	bool writeCube = false;
+	//Voice groups whose files need writing
+	int voiceCount = 0;
+	std::string path;
+	CubeFileHeader header;
+	Cube<MAX_CHANNELS> cube;
+	//Polyphonic voice cubes, one per group of four voices
+	std::string voicePaths [POLY_GROUPS];
+	Cube<MAX_CHANNELS, simd::float_4> voiceCubes [POLY_GROUPS];
+};
+
+//How long onSave and exportCubeWav wait for process() to take a snapshot before taking it themselves
+#define AUDIO_THREAD_TIMEOUT_MS 500
+
+enum SnapshotState {
+	SNAPSHOT_IDLE,
+	SNAPSHOT_REQUESTED,
+	SNAPSHOT_TAKING,
+	SNAPSHOT_TAKEN,
+};
+
 void writeDoubleBuffer(std::ostream * out, dsp::DoubleRingBuffer<float,PITCH_BUFF_SIZE> * buffer){
 	out->write( (char *)& buffer->start, sizeof(float));
 	out->write( (char *)& buffer->end, sizeof(float));
@@ -194,6 +180,47 @@ void readDoubleBuffer(std::fstream * in, dsp::DoubleRingBuffer<float,PITCH_BUFF_
 	in->read( (char *)& buffer->data, PITCH_BUFF_SIZE * 2 * sizeof(float));
 }
 
+//Writes count samples of the line from + slope * step, for steps firstStep, firstStep + 1, ...
+//Four samples are written per float_4
+void writeRamp(float* samples, int count, float from, float slope, float firstStep){
+	simd::float_4 value = from + slope * (firstStep + simd::float_4(0.f, 1.f, 2.f, 3.f));
+	simd::float_4 increment = slope * 4.f;
+	int si = 0;
+	for(; si + 4 <= count; si += 4){
+		value.store(samples + si);
+		value += increment;
+	}
+	for(int li = 0; si < count; si++, li++){
+		samples[si] = value[li];
+	}
+}
+
+//writeRamp for four voices at once, each sample is one frame of four voices
+void writeRamp(simd::float_4* samples, int count, simd::float_4 from, simd::float_4 slope, float firstStep){
+	simd::float_4 value = from + slope * firstStep;
+	for(int si = 0; si < count; si++){
+		samples[si] = value;
+		value += slope;
+	}
+}
+
+#define RAMP_CHUNK 64
+
+//Records count frames of the writeRamp line from + slope * step into one channel of a cube, starting at frame
+//The ramp is built in chunks and encoded into the cube's pages a chunk at a time
+//Returns false if any frames were dropped, see Cube::writeSamples
+template <typename T>
+bool recordRamp(Cube<MAX_CHANNELS, T>& cube, int channel, int frame, int count, T from, T slope){
+	T ramp [RAMP_CHUNK];
+	bool written = true;
+	for(int d = 0; d < count; d += RAMP_CHUNK){
+		int span = std::min(RAMP_CHUNK, count - d);
+		writeRamp(ramp, span, from, slope, d);
+		written &= cube.writeSamples(channel, frame + d, ramp, span);
+	}
+	return written;
+}
+
 struct IceTray : Module {
 	enum ParamId {
 		SPEED_NUM_PARAM,
@@ -208,7 +235,7 @@ struct IceTray : Module {
 		PATERN_PARAM,		
 		FEEDBACK_PARAM,		
 		FEEDBACK_CK_PARAM,	
-		ENUMS(CUBE_SWITCH_PARAM, BUFFER_COUNT),
+		ENUMS(CUBE_SWITCH_PARAM, PANEL_CUBE_COUNT),
 		PARAMS_LEN,		
 	};
 	enum InputId {
@@ -230,8 +257,8 @@ struct IceTray : Module {
 		OUTPUTS_LEN
 	};
 	enum LightId {
-		ENUMS(CUBE_LIGHT, BUFFER_COUNT),
-		ENUMS(RP_LIGHT, BUFFER_COUNT * 3),
+		ENUMS(CUBE_LIGHT, PANEL_CUBE_COUNT),
+		ENUMS(RP_LIGHT, PANEL_CUBE_COUNT * 3),
 		LIGHTS_LEN
 	};
 
@@ -241,14 +268,119 @@ struct IceTray : Module {
 		ALL,
 	};
 
-	float buffers [BUFFER_COUNT][BUFFER_SIZE_MAX][MAX_CHANNELS];
-	LockLevel bufferLockLevel [BUFFER_COUNT] = {NONE,NONE,NONE,ALL,ALL,ALL};
-	int loopSize [BUFFER_COUNT];
+	enum PitchCorrection {
+		PITCH_CORRECTION_OFF,
+		PITCH_CORRECTION_TIME_DOMAIN,
+		PITCH_CORRECTION_SPECTRAL,
+	};
+
+	typedef float Frame [MAX_CHANNELS];
+
+	//Only the first cubeCount cubes are in use, the rest hold no pages
+	int cubeCount = PANEL_CUBE_COUNT;
+	//Set from the context menu, the count is changed on the audio thread since removing cubes frees pages
+	std::atomic<int> cubeCountRequested {0};
+
+	//Cube storage is paged on the heap or lives in a mapped cube file, see allocateCubes
+	Cube<MAX_CHANNELS> buffers [CUBE_COUNT_MAX];
+	MappedFile cubeMaps [CUBE_COUNT_MAX];
+	std::string cubeMapDir;
+	int bufferSizeMax = 0;
+	float sampleRate = ASSUMED_SAMPLE_RATE;
+	//Set by clearCubes
+	LockLevel bufferLockLevel [CUBE_COUNT_MAX];
+	int loopSize [CUBE_COUNT_MAX] = {};
+
+	//Record boundary fades, applied by getPlaybackOuput rather than written into the cube
+	//Cubes from older versions have their fades baked in, so they have neither
+	bool cubeFadeIn [CUBE_COUNT_MAX] = {};
+	//Frame the cube fades out to and back in from, -1 while the cube is recording or has no fade, set by clearCubes
+	int cubeFadeOutAt [CUBE_COUNT_MAX];
+
+	//Waveform peaks of each panel cube, kept up to date as the cube is recorded, see CubeOverview and overviewOf
+	CubeOverview overviews [PANEL_CUBE_COUNT];
+
+	//Bumped whenever a cube's audio changes, compared against the generation last written to disk
+	//Atomic since onSave reads it for mapped cubes while process() bumps it
+	std::atomic<uint32_t> cubeGeneration [CUBE_COUNT_MAX] = {};
+	uint32_t savedCubeGeneration [CUBE_COUNT_MAX] = {};
+
+	//Cube files are read and written on this thread
+	Worker cubeIO;
+	std::atomic<bool> cubesLoading {false};
+	std::atomic<bool> cancelCubeIO {false};
+
+	//onSave asks process() to take snapshots, since only the thread writing the cubes may share their pages
+	std::atomic<int> snapshotState {SNAPSHOT_IDLE};
+	//Set while process() or processBypass() runs, and while another thread keeps them out to take a snapshot itself, see ProcessGuard
+	std::atomic<bool> inProcess {false};
+	std::atomic<bool> processLockedOut {false};
+	bool snapshotMissing [CUBE_COUNT_MAX] = {};
+	//cubeCount when the snapshots were taken, files of cubes past it are removed once they are written
+	int snapshotCubeCount = PANEL_CUBE_COUNT;
+	//One per possible cube and the crossfades.dat contents, see prepareSnapshots
+	std::shared_ptr<std::vector<CubeSnapshot>> snapshots;
+	std::shared_ptr<std::vector<float>> crossFadeSnapshot;
+
+	//Export asks process() to share one cube's pages, the worker thread then streams them to a WAV file
+	//Mapped pages can't be shared, process() copies a mapped cube into exportCopy a page per sample before the export is taken
+	std::atomic<int> exportState {SNAPSHOT_IDLE};
+	int exportBuffer = 0;
+	Cube<MAX_CHANNELS> exportSnapshot;
+	std::shared_ptr<CubeCopy<MAX_CHANNELS>> exportCopy;
+	bool exportMapped = false;
+	int exportLoopSize = 0;
+	bool exportFadeIn = false;
+	int exportFadeOutAt = -1;
+
+	//Import decodes a WAV file into importedCube on the worker thread, process() then installs it into importBuffer
+	//The worker only touches importedCube while importReady is clear
+	std::atomic<bool> importReady {false};
+	int importBuffer = 0;
+	int importLoopSize = 0;
+	Cube<MAX_CHANNELS> importedCube;
+	CubeOverview importedOverview;
+
+	//Set when a recording wasn't started because the plugin's cube memory limit was reached, see recordingFits
+	bool recordingBlocked = false;
+
+	//Set from the context menu, cubes are cleared on the audio thread since clearing frees pages
+	std::atomic<bool> clearCubesRequested {false};
+
+	//Polyphonic mode records each input channel as its own voice, with polyphonic outputs
+	//Voices share the transport (clocks, cube choice, loop sizes and fades) and each keep their own audio, four voices to a float_4
+	bool polyphonic = false;
+	//Groups of four voices recorded since the cubes were cleared, only these are saved and loaded
+	int voiceGroups = 0;
+	Cube<MAX_CHANNELS, simd::float_4> voiceBuffers [POLY_GROUPS][CUBE_COUNT_MAX];
+	simd::float_4 voicePreBuffer [POLY_GROUPS][MAX_CHANNELS][CROSS_FADE_AMT];
+	simd::float_4 voicePrevInput [POLY_GROUPS][MAX_CHANNELS];
+	simd::float_4 voiceFeedback [POLY_GROUPS][MAX_CHANNELS];
+	dsp::TRCFilter<simd::float_4> voiceLowpassFilter [POLY_GROUPS][MAX_CHANNELS];
+	dsp::TRCFilter<simd::float_4> voiceHighpassFilter [POLY_GROUPS][MAX_CHANNELS];
+	//Voices are always shifted in the time domain, a phase vocoder per voice would cost as much as separate modules
+	GrainShifter<simd::float_4> voiceGrainShifter [POLY_GROUPS];
+	//Cube generation last written to the voice files, mapped cubes sync their own file separately
+	uint32_t savedVoiceGeneration [CUBE_COUNT_MAX] = {};
+
+	//A playhead that keeps reading the cube it left while it fades out, see playback_jumpToNextTrack
+	struct FadeVoice {
+		int buffer = 0;
+		int index = 0;
+		int loopSize = 0;
+		int fadeInStart = 0;
+		bool runover = false;
+		//Frames into the fade out, the voice is free once this reaches CROSS_FADE_AMT
+		int position = CROSS_FADE_AMT;
+	};
+	FadeVoice fadeVoices [FADE_VOICES];
 
-	float playbackCrossFadeBuffer [CROSS_FADE_AMT][MAX_CHANNELS];
-	int playbackCrossFadeBufferIndex = 0;
-	float recordCrossFadePreBuffer [CROSS_FADE_AMT][MAX_CHANNELS];
+	//Planar like the cubes, saved interleaved in crossfades.dat
+	float recordCrossFadePreBuffer [MAX_CHANNELS][CROSS_FADE_AMT];
 	float recordCrossFadePreBufferIndex = 0;
+	//Pre-roll not yet copied to the record cube, frame preRollCopied comes from frame preRollOldest + preRollCopied of the pre record buffer, see copyPreRoll
+	int preRollOldest = 0;
+	int preRollCopied = PRE_ROLL_FRAMES;
 
 	float recordIndex = 0;
 	int recordBuffer = 0;
@@ -263,21 +395,36 @@ struct IceTray : Module {
 	int playbackRepeatCount = 0;
 
 	int nextReadPatternIndex = -1;
+	//Cube orders of the positive playback patterns, generated for the cube count as the pattern changes
+	ReadPatternOrders readPatterns;
 
 	float prevInput [MAX_CHANNELS] = {0,0};
 	int fadeInStart = 0;
 
-	dsp::TRCFilter<float> lowpassFilter [MAX_CHANNELS];
-	dsp::TRCFilter<float> highpassFilter [MAX_CHANNELS];
+	//Both channels filtered at once, left and right in the first two lanes
+	dsp::TRCFilter<simd::float_4> lowpassFilter;
+	dsp::TRCFilter<simd::float_4> highpassFilter;
 
-	dsp::DoubleRingBuffer<float, PITCH_BUFF_SIZE> in_Buffer [MAX_CHANNELS];
-	dsp::DoubleRingBuffer<float, PITCH_BUFF_SIZE> ps_Buffer [MAX_CHANNELS];
-	PitchShifter *pShifter [MAX_CHANNELS];
+	//Fed one stereo sample at a time, runs one FFT frame per hop rather than a whole block at once
+	PitchShifter *pShifter;
+	//Low latency alternative to pShifter
+	GrainShifter<float> grainShifter;
 
-	bool cubeButtonDown [BUFFER_COUNT];
-	bool cubeButtonDir [BUFFER_COUNT];
+	bool cubeButtonDown [PANEL_CUBE_COUNT] = {};
+	bool cubeButtonDir [PANEL_CUBE_COUNT] = {};
 
-	bool pitchCorrectionOn = true;
+	int pitchCorrection = PITCH_CORRECTION_SPECTRAL;
+
+	//Back cubes with memory mapped cube files, takes effect the next time the module is added
+	bool mapCubes = false;
+
+	//CubeEncoding of newly written cube pages, set from the context menu
+	//process() hands it to the cubes and then converts their older pages a few at a time, see convertCubeEncoding
+	int cubeEncoding = CUBE_FLOAT32;
+	int cubeCompression = CUBE_COMPRESSION_LOSSLESS;
+	bool encodingPending = false;
+	int encodingCube = 0;
+	int encodingPage = 0;
 
 	IceTray() {
 		config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -294,7 +441,7 @@ struct IceTray : Module {
 		configParam(PATERN_PARAM, -1.f, 1.f, 0.f, "Playback Pattern");
 		configParam(FEEDBACK_PARAM, 0.f, 1.f, 0.0f, "Feedback Percent", "%", 0.f, 100.f, 0.f);
 		configParam(FEEDBACK_CK_PARAM, -1.f, 1.f, 0.f, "Frozen Percent CV Scalar", "%", 0.f, 100.f, 0.f);
-		for(int i = 0; i < BUFFER_COUNT; i++){
+		for(int i = 0; i < PANEL_CUBE_COUNT; i++){
 			std::string cs = std::to_string(i+1);
 			configButton(CUBE_SWITCH_PARAM + i, "Cube " + cs);
 		}
@@ -315,46 +462,154 @@ struct IceTray : Module {
 		configBypass(LEFT_INPUT, LEFT_OUTPUT);
 		configBypass(RIGHT_INPUT, RIGHT_OUTPUT);
 
-		pShifter[0] = new PitchShifter();
-		pShifter[1] = new PitchShifter();
+		pShifter = new PitchShifter();
 
 		// Initialize filter cutoffs with default sample rate (44100)
 		float defaultSampleRate = 44100.0f;
-		lowpassFilter[0].setCutoff(20000 / defaultSampleRate);
-		lowpassFilter[1].setCutoff(20000 / defaultSampleRate);
-		highpassFilter[0].setCutoff(20 / defaultSampleRate);
-		highpassFilter[1].setCutoff(20 / defaultSampleRate);
+		lowpassFilter.setCutoff(20000 / defaultSampleRate);
+		highpassFilter.setCutoff(20 / defaultSampleRate);
+		setVoiceFilterCutoffs(defaultSampleRate);
 
+		loadCubeBudgetSettings();
+		reserveCubePages();
 		clearCubes();
-		in_Buffer[0].clear();
-		in_Buffer[1].clear();
-		ps_Buffer[0].clear();
-		ps_Buffer[1].clear();
 	}
 
 	~IceTray() override {
-		delete pShifter[0];
-		delete pShifter[1];
+		waitForCubeIO(true);
+		delete pShifter;
 	}
 
+	//Has the page pool keep pages of the encoding and sample type process() writes ready, so recording never allocates
+	//Call off the audio thread whenever cubeEncoding or polyphonic changes
+	void reserveCubePages(){
+		cubePagePool().reserve(Cube<MAX_CHANNELS>::Page::blockBytes(cubeEncoding));
+		if(polyphonic) cubePagePool().reserve(Cube<MAX_CHANNELS, simd::float_4>::Page::blockBytes(cubeEncoding));
+	}
+
+	//Number of frames a cube needs to hold the longest recording plus its cross fades at this sample rate
+	int cubeSizeFor(float rate){
+		float maxSeconds = paramQuantities[RECORD_LENGTH_PARAM]->maxValue;
+		return static_cast<int>((maxSeconds + CROSS_FADE_SECONDS * 2) * rate) + 2;
+	}
+
+	//(Re)allocates the cubes for the given sample rate, keeping as much of the existing audio as fits
+	//When cubeMapDir is set the cubes are mapped from their cube files instead of allocated
+	void allocateCubes(float rate){
+		if(rate <= 0) return;
+		sampleRate = rate;
+		int newSize = cubeSizeFor(rate);
+		if(newSize == bufferSizeMax) return;
+
+		waitForCubeIO(false);
+		for(int bi = 0; bi < CUBE_COUNT_MAX; bi++){
+			//Cubes past the count keep no storage, a mapped one's file is closed
+			if(bi >= cubeCount){
+				releaseCube(bi);
+				cubeMaps[bi].close();
+				continue;
+			}
+			if(!cubeMapDir.empty() && mapCube(bi, newSize)){
+				//The file keeps the audio, mapCube just resizes it
+			}else{
+				buffers[bi].unmap();
+				cubeMaps[bi].close();
+				buffers[bi].resize(newSize);
+			}
+			for(int gi = 0; gi < POLY_GROUPS; gi++){
+				voiceBuffers[gi][bi].resize(newSize);
+			}
+			loopSize[bi] = clamp(loopSize[bi], 0, newSize - CROSS_FADE_AMT);
+			cubeGeneration[bi]++;
+		}
+		bufferSizeMax = newSize;
+
+		//The overview bins depend on the cube size
+		for(int bi = 0; bi < cubeCount; bi++){
+			rebuildOverview(bi);
+		}
+
+		recordIndex = clamp(recordIndex, 0.f, (float)(newSize - CROSS_FADE_AMT));
+		playbackIndex = clamp(playbackIndex, 0, newSize - CROSS_FADE_AMT);
+	}
+
+	//Maps cubeN.dat as the storage for a cube of the given size, growing the file as needed
+	//Pages are only read in as playback and recording touch them, which makes loading instant
+	bool mapCube(int bi, int size){
+		std::string path = system::join(cubeMapDir, cubeFileName(bi));
+		buffers[bi].unmap();
+
+		//Version 1 and compressed files can't be mapped, read them in so they can be rewritten as whole pages
+		Cube<MAX_CHANNELS> migrated;
+		bool migrate = readUnmappableCube(path, migrated, size);
+
+		//A mapped file keeps the encoding it was created with, new files use the module's
+		CubeFileHeader existing;
+		bool reuse = !migrate && readCubeHeader(path, existing) && existing.version == CUBE_FILE_MAPPED_VERSION;
+		int encoding = reuse ? existing.encoding : cubeEncoding;
+
+		size_t pageBytes = Cube<MAX_CHANNELS>::Page::bytes(encoding);
+		if(!cubeMaps[bi].open(path, CUBE_FILE_DATA_OFFSET + Cube<MAX_CHANNELS>::pageCount(size) * pageBytes)){
+			DEBUG("Unable to map cube file '%s'",path.c_str());
+			return false;
+		}
+
+		CubeFileHeader* header = (CubeFileHeader*)cubeMaps[bi].data;
+		buffers[bi].map(cubeMaps[bi].data + CUBE_FILE_DATA_OFFSET, size, encoding);
+		if(!reuse){
+			//New, unreadable or migrated file, start from silence
+			uint32_t loop = migrate ? header->loopSize : 0;
+			uint32_t generation = migrate ? header->generation : cubeGeneration[bi].load();
+			memset(cubeMaps[bi].data, 0, cubeMaps[bi].size);
+			memcpy(header->magic, CUBE_FILE_MAGIC, sizeof header->magic);
+			header->version = CUBE_FILE_MAPPED_VERSION;
+			header->channels = MAX_CHANNELS;
+			header->loopSize = loop;
+			header->generation = generation;
+			header->encoding = encoding;
+			if(migrate){
+				DEBUG("Migrating cube file '%s' to version %i",path.c_str(),CUBE_FILE_MAPPED_VERSION);
+				buffers[bi].shareFrom(migrated, size);
+			}
+		}
+		header->frameCount = size;
+		cubeGeneration[bi] = header->generation;
+		savedCubeGeneration[bi] = header->generation;
+		return true;
+	}
+
+	//Must not run while process() does, use clearCubesRequested from other threads
 	void clearCubes(){
-		memset(buffers, 0, sizeof buffers);
-		bufferLockLevel[0] = NONE;
-		bufferLockLevel[1] = NONE;
-		bufferLockLevel[2] = NONE;
-		bufferLockLevel[3] = ALL;
-		bufferLockLevel[4] = ALL;
-		bufferLockLevel[5] = ALL;
+		for(int bi = 0; bi < cubeCount; bi++){
+			buffers[bi].clear();
+			for(int gi = 0; gi < POLY_GROUPS; gi++){
+				voiceBuffers[gi][bi].clear();
+			}
+			if(CubeOverview* overview = overviewOf(bi)) overview->clear();
+			cubeGeneration[bi]++;
+		}
+		//The first half of the cubes start recordable and the rest frozen
+		for(int bi = 0; bi < CUBE_COUNT_MAX; bi++){
+			bufferLockLevel[bi] = bi < (cubeCount + 1) / 2 ? NONE : ALL;
+		}
 		memset(loopSize, 0, sizeof loopSize);
-		memset(playbackCrossFadeBuffer, 0, sizeof playbackCrossFadeBuffer);
+		for(int bi = 0; bi < CUBE_COUNT_MAX; bi++){
+			cubeFadeIn[bi] = false;
+			cubeFadeOutAt[bi] = -1;
+		}
+		for(int vi = 0; vi < FADE_VOICES; vi++) fadeVoices[vi].position = CROSS_FADE_AMT;
 		memset(recordCrossFadePreBuffer, 0, sizeof recordCrossFadePreBuffer);
+		memset(voicePreBuffer, 0, sizeof voicePreBuffer);
+		memset(voicePrevInput, 0, sizeof voicePrevInput);
+		memset(voiceFeedback, 0, sizeof voiceFeedback);
+		voiceGroups = 0;
 
 		recordIndex = 0;
 		recordBuffer = 0;
 		playbackIndex = 0;
 		playbackBuffer = -1;
-		playbackCrossFadeBufferIndex = 0;
 		recordCrossFadePreBufferIndex = 0;
+		preRollCopied = PRE_ROLL_FRAMES;
 
 		playbackClockHigh = false;
 		recordClockHigh = false;
@@ -374,62 +629,835 @@ struct IceTray : Module {
 		updateRecordAndPlaybackLights();
 	}
 
+	//Changes the number of cubes, must not run while process() does, use cubeCountRequested from other threads
+	//Cubes past the new count lose their audio, added cubes start empty and recordable
+	//Mapped storage for added cubes starts the next time the patch is loaded, until then they are kept in memory
+	void setCubeCount(int count){
+		count = clamp(count, CUBE_COUNT_MIN, CUBE_COUNT_MAX);
+		for(int bi = count; bi < cubeCount; bi++){
+			releaseCube(bi);
+			if(CubeOverview* overview = overviewOf(bi)) overview->clear();
+		}
+		for(int bi = cubeCount; bi < count; bi++){
+			buffers[bi].resize(bufferSizeMax);
+			for(int gi = 0; gi < POLY_GROUPS; gi++){
+				voiceBuffers[gi][bi].resize(bufferSizeMax);
+			}
+			if(CubeOverview* overview = overviewOf(bi)) overview->resize(bufferSizeMax);
+			bufferLockLevel[bi] = NONE;
+			cubeGeneration[bi]++;
+		}
+		cubeCount = count;
+
+		for(int vi = 0; vi < FADE_VOICES; vi++){
+			if(fadeVoices[vi].buffer >= count) fadeVoices[vi].position = CROSS_FADE_AMT;
+		}
+		if(recordBuffer >= count){
+			recordBuffer = -1;
+			preRollCopied = PRE_ROLL_FRAMES;
+		}
+		if(playbackBuffer >= count) playbackBuffer = -1;
+		if(nextReadPatternIndex >= count) nextReadPatternIndex = 0;
+		//convertCubeEncoding walks the cubes by count, start its pass over
+		encodingCube = 0;
+		encodingPage = 0;
+	}
+
+	//Drops every page of a cube past the count and forgets its loop, its mapped file stays open until allocateCubes
+	void releaseCube(int bi){
+		buffers[bi].unmap();
+		buffers[bi].resize(0);
+		for(int gi = 0; gi < POLY_GROUPS; gi++){
+			voiceBuffers[gi][bi].resize(0);
+		}
+		loopSize[bi] = 0;
+		cubeFadeIn[bi] = false;
+		cubeFadeOutAt[bi] = -1;
+		cubeGeneration[bi]++;
+	}
+
+	//Overview of a cube, NULL for cubes without a waveform on the panel
+	CubeOverview* overviewOf(int bi){
+		return bi < PANEL_CUBE_COUNT ? &overviews[bi] : NULL;
+	}
+
 	void onReset(const ResetEvent& e) override {
 		Module::onReset(e);
 
+		waitForCubeIO(true);
+		setCubeCount(PANEL_CUBE_COUNT);
 		clearCubes();
-		in_Buffer[0].clear();
-		in_Buffer[1].clear();
-		ps_Buffer[0].clear();
-		ps_Buffer[1].clear();
+		pShifter->reset();
+		grainShifter.reset();
+
+		pitchCorrection = PITCH_CORRECTION_SPECTRAL;
+
+		lowpassFilter.reset();
+		highpassFilter.reset();
+		for(int gi = 0; gi < POLY_GROUPS; gi++){
+			voiceGrainShifter[gi].reset();
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				voiceLowpassFilter[gi][ci].reset();
+				voiceHighpassFilter[gi][ci].reset();
+			}
+		}
+	}
+
+	//Pages already written keep their encoding until convertCubeEncoding reaches them
+	//Cubes are rewritten on the next save, mapped cubes keep the encoding of their file
+	void setCubeEncoding(int encoding){
+		//Cubes past the count too, so they are ready if it grows
+		for(int bi = 0; bi < CUBE_COUNT_MAX; bi++){
+			buffers[bi].encoding = encoding;
+			for(int gi = 0; gi < POLY_GROUPS; gi++){
+				voiceBuffers[gi][bi].encoding = encoding;
+			}
+			cubeGeneration[bi]++;
+		}
+		encodingPending = true;
+		encodingCube = 0;
+		encodingPage = 0;
+	}
 
-		pitchCorrectionOn = true;
+	//Converts at most one page per sample to the cubes' encoding, checking a few pages each time
+	//A whole pass over every cube takes a fraction of a second and never stalls the audio thread
+	void convertCubeEncoding(){
+		for(int check = 0; check < 8; check++){
+			int bi = encodingCube % cubeCount;
+			int gi = encodingCube / cubeCount - 1;
+			int pages;
+			bool converted;
+			if(gi < 0){
+				pages = buffers[bi].pages.size();
+				converted = encodingPage < pages && buffers[bi].convertPage(encodingPage);
+			}else{
+				pages = voiceBuffers[gi][bi].pages.size();
+				converted = encodingPage < pages && voiceBuffers[gi][bi].convertPage(encodingPage);
+			}
+			if(++encodingPage >= pages){
+				encodingPage = 0;
+				if(++encodingCube >= cubeCount * (POLY_GROUPS + 1)){
+					encodingCube = 0;
+					encodingPending = false;
+					return;
+				}
+			}
+			if(converted) return;
+		}
+	}
 
-		lowpassFilter[0].reset();
-		lowpassFilter[1].reset();
-		highpassFilter[0].reset();
-		highpassFilter[1].reset();
+	void setVoiceFilterCutoffs(float rate){
+		for(int gi = 0; gi < POLY_GROUPS; gi++){
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				voiceLowpassFilter[gi][ci].setCutoff(20000 / rate);
+				voiceHighpassFilter[gi][ci].setCutoff(20 / rate);
+			}
+		}
 	}
 
 	void onAdd(const AddEvent& e) override {
-		std::string path = system::join(createPatchStorageDirectory(), "buffers.dat");
-		DEBUG("Reading data file '%s' ",path.c_str());
-		// Read file...
-		std::fstream dataFile(path, ios::binary | ios::in);
-		if (dataFile.is_open())
-		{
-			DEBUG("Data file is open");
-	    	dataFile.read( (char *)& buffers[0][0][0], BUFFER_COUNT * BUFFER_SIZE_MAX * MAX_CHANNELS * sizeof(float) );
-			dataFile.read( (char *)& playbackCrossFadeBuffer[0][0], CROSS_FADE_AMT * MAX_CHANNELS * sizeof(float) );
-			dataFile.read( (char *)& recordCrossFadePreBuffer[0][0], CROSS_FADE_AMT * MAX_CHANNELS * sizeof(float) );
-			// readDoubleBuffer(& dataFile, & in_Buffer[0]);
-			// readDoubleBuffer(& dataFile, & in_Buffer[1]);
-			// readDoubleBuffer(& dataFile, & ps_Buffer[0]);
-			// readDoubleBuffer(& dataFile, & ps_Buffer[1]);
-	    	dataFile.close();
-	  	}
-	  	else
-	  	{
-	  		DEBUG("Unable to open data file");
-	  	}
+		std::string dir = createPatchStorageDirectory();
+		std::string legacyPath = system::join(dir, "buffers.dat");
+		bool legacy = system::exists(legacyPath);
+		if(mapCubes && !legacy) cubeMapDir = dir;
+
+		//Size the cubes before reading so recordings made at a higher sample rate aren't truncated
+		allocateCubes(APP->engine->getSampleRate());
+
+		//Read the cubes on the worker thread, process() passes audio through until they are ready
+		//Cube files may be in another encoding, process() converts them once they are loaded
+		encodingPending = true;
+		cubesLoading = true;
+		cubeIO.push([=](){
+			if(legacy){
+				loadLegacyBuffers(legacyPath);
+			}else{
+				for(int bi = 0; bi < cubeCount; bi++){
+					if(!cubeMaps[bi].isOpen()) loadCube(system::join(dir, cubeFileName(bi)), bi);
+					if(polyphonic) loadVoiceCubes(dir, bi);
+				}
+				loadCrossFades(system::join(dir, "crossfades.dat"));
+			}
+			//allocateCubes already built the overviews of mapped cubes
+			for(int bi = 0; bi < cubeCount && !cancelCubeIO; bi++){
+				if(legacy || !cubeMaps[bi].isOpen() || polyphonic) rebuildOverview(bi);
+			}
+			cubesLoading = false;
+		});
 
 		updateCubeLights();
 		updateRecordAndPlaybackLights();
 	}
 
 	void onSave(const SaveEvent& e) override {
-		std::string path = system::join(createPatchStorageDirectory(), "buffers.dat");
-		DEBUG("Saving data file '%s' ",path.c_str());
-		// Write file...
-		std::fstream dataFile(path, ios::binary | ios::out);
-		dataFile.write( (char *)& buffers[0][0][0], BUFFER_COUNT * BUFFER_SIZE_MAX * MAX_CHANNELS * sizeof(float) );
-		dataFile.write( (char *)& playbackCrossFadeBuffer[0][0], CROSS_FADE_AMT * MAX_CHANNELS * sizeof(float) );
-		dataFile.write( (char *)& recordCrossFadePreBuffer[0][0], CROSS_FADE_AMT * MAX_CHANNELS * sizeof(float) );
-		// writeDoubleBuffer(& dataFile, & in_Buffer[0]);
-		// writeDoubleBuffer(& dataFile, & in_Buffer[1]);
-		// writeDoubleBuffer(& dataFile, & ps_Buffer[0]);
-		// writeDoubleBuffer(& dataFile, & ps_Buffer[1]);
+		//Let any load or earlier save finish first so files are written in order
+		waitForCubeIO(false);
+
+		std::string dir = createPatchStorageDirectory();
+		//A save interrupted by a crash can leave a temporary file behind, it must not end up in the patch
+		for(const std::string& path : system::getEntries(dir)){
+			if(system::getExtension(path) == ".tmp") system::remove(path);
+		}
+		for(int bi = 0; bi < cubeCount; bi++){
+			if(cubeMaps[bi].isOpen()){
+				syncMappedCube(bi);
+				snapshotMissing[bi] = false;
+			}else{
+				snapshotMissing[bi] = !system::exists(system::join(dir, cubeFileName(bi)));
+			}
+			if(polyphonic && voiceGroups > 0 && !system::exists(system::join(dir, voiceCubeFileName(bi, voiceGroups - 1)))){
+				snapshotMissing[bi] = true;
+			}
+		}
+		prepareSnapshots(dir);
+
+		//The snapshot can't be taken here, process() may be writing the same pages
+		awaitAudioThread(snapshotState, &IceTray::takeSnapshots);
+
+		std::shared_ptr<std::vector<CubeSnapshot>> taken = snapshots;
+		std::shared_ptr<std::vector<float>> crossFades = crossFadeSnapshot;
+		snapshots.reset();
+		crossFadeSnapshot.reset();
+		int count = snapshotCubeCount;
+		snapshotState = SNAPSHOT_IDLE;
+
+		//process() has already unmapped cubes past the count, their files can be closed and removed
+		for(int bi = count; bi < CUBE_COUNT_MAX; bi++){
+			cubeMaps[bi].close();
+		}
+
+		//Written on the worker thread, in order with loads and exports
+		cubeIO.push([=](){
+			for(int bi = 0; bi < count; bi++){
+				const CubeSnapshot& snapshot = (*taken)[bi];
+				//A cube stays unsaved if its file couldn't be written, so the next save tries again
+				if(snapshot.writeCube && writeCubeFile(snapshot.path, snapshot.header, snapshot.cube)){
+					savedCubeGeneration[bi] = snapshot.header.generation;
+				}
+				bool voicesWritten = true;
+				for(int gi = 0; gi < snapshot.voiceCount; gi++){
+					voicesWritten &= writeCubeFile(snapshot.voicePaths[gi], snapshot.header, snapshot.voiceCubes[gi]);
+				}
+				if(snapshot.voiceCount > 0 && voicesWritten) savedVoiceGeneration[bi] = snapshot.header.generation;
+			}
+			writeFileAtomic(system::join(dir, "crossfades.dat"), (const char *) crossFades->data(), crossFades->size() * sizeof(float));
+
+			//Cubes removed since the patch was last saved
+			for(int bi = count; bi < CUBE_COUNT_MAX; bi++){
+				std::string path = system::join(dir, cubeFileName(bi));
+				if(system::exists(path)) system::remove(path);
+				for(int gi = 0; gi < POLY_GROUPS; gi++){
+					std::string voicePath = system::join(dir, voiceCubeFileName(bi, gi));
+					if(system::exists(voicePath)) system::remove(voicePath);
+				}
+			}
+
+			//Everything from the old single file format now lives in the cube files
+			std::string legacyPath = system::join(dir, "buffers.dat");
+			if(system::exists(legacyPath)) system::remove(legacyPath);
+		});
+		//Rack archives the patch storage as soon as every module's onSave returns, so the cube files must be complete by then
+		cubeIO.wait();
+	}
+
+	//Has process() run take, and waits until the snapshot is taken
+	//When the engine isn't calling process() (audio device stopped, engine paused) the calling thread keeps it out and takes the snapshot itself, so saves never skip cubes
+	void awaitAudioThread(std::atomic<int>& state, void (IceTray::*take)()){
+		state = SNAPSHOT_REQUESTED;
+		for(int wait = 0; wait < AUDIO_THREAD_TIMEOUT_MS && state != SNAPSHOT_TAKEN; wait++){
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if(state == SNAPSHOT_TAKEN) return;
+
+		processLockedOut = true;
+		while(inProcess){
+			std::this_thread::yield();
+		}
+		int expected = SNAPSHOT_REQUESTED;
+		if(state.compare_exchange_strong(expected, SNAPSHOT_TAKING)) (this->*take)();
+		//An export copy process() started is finished here
+		while(state != SNAPSHOT_TAKEN){
+			stepExportCopy();
+		}
+		processLockedOut = false;
+	}
+
+	//Marks process() as running for its whole call, or tells it to return at once while another thread holds it out in awaitAudioThread
+	//Both flags are sequentially consistent, so either process() sees the lock out or awaitAudioThread sees it running
+	struct ProcessGuard {
+		IceTray* module;
+		bool entered;
+
+		ProcessGuard(IceTray* module) : module(module) {
+			module->inProcess = true;
+			entered = !module->processLockedOut;
+			if(!entered) module->inProcess = false;
+		}
+
+		~ProcessGuard(){
+			if(entered) module->inProcess = false;
+		}
+	};
+
+	void serviceRequest(std::atomic<int>& state, void (IceTray::*take)()){
+		if(state.load(std::memory_order_acquire) != SNAPSHOT_REQUESTED) return;
+		int expected = SNAPSHOT_REQUESTED;
+		if(state.compare_exchange_strong(expected, SNAPSHOT_TAKING)){
+			(this->*take)();
+		}
+	}
+
+	//Called from process() or processBypass() to answer requests from onSave and exportCubeWav
+	void serviceSnapshotRequests(){
+		serviceRequest(snapshotState, &IceTray::takeSnapshots);
+		serviceRequest(exportState, &IceTray::takeExport);
+		stepExportCopy();
+	}
+
+	//Builds the snapshots takeSnapshots fills in, for every cube the count could reach, so the audio thread never allocates
+	//Page tables are reserved for the largest cube, so sharing pages into them only copies pointers
+	void prepareSnapshots(std::string dir){
+		int pages = Cube<MAX_CHANNELS>::pageCount(bufferSizeMax);
+		snapshots = std::make_shared<std::vector<CubeSnapshot>>(CUBE_COUNT_MAX);
+		for(int bi = 0; bi < CUBE_COUNT_MAX; bi++){
+			CubeSnapshot& snapshot = (*snapshots)[bi];
+			snapshot.path = system::join(dir, cubeFileName(bi));
+			snapshot.cube.pages.reserve(pages);
+			//Polyphony is only switched from this thread, so it can't change before the snapshot is taken
+			for(int gi = 0; polyphonic && gi < POLY_GROUPS; gi++){
+				snapshot.voicePaths[gi] = system::join(dir, voiceCubeFileName(bi, gi));
+				snapshot.voiceCubes[gi].pages.reserve(pages);
+			}
+			CubeFileHeader& header = snapshot.header;
+			memcpy(header.magic, CUBE_FILE_MAGIC, sizeof header.magic);
+			header.version = CUBE_FILE_VERSION;
+			header.channels = MAX_CHANNELS;
+			header.encoding = cubeCompression == CUBE_COMPRESSION_LOSSY ? CUBE_INT16 : cubeEncoding;
+		}
+		//Fading playheads aren't saved, the first half of the file stays silent for older versions
+		crossFadeSnapshot = std::make_shared<std::vector<float>>(2 * CROSS_FADE_AMT * MAX_CHANNELS, 0.f);
+	}
+
+	//Shares the pages of every cube that changed since it was last saved into the prepared snapshots, only O(pages) per cube
+	void takeSnapshots(){
+		//Saved cubes always hold their whole pre-roll
+		copyPreRoll(PRE_ROLL_FRAMES);
+		snapshotCubeCount = cubeCount;
+		for(int bi = 0; bi < cubeCount; bi++){
+			CubeSnapshot& snapshot = (*snapshots)[bi];
+			//Only rewrite cubes that changed since they were last written, mapped cubes are already in their file
+			snapshot.writeCube = !buffers[bi].mapped && (savedCubeGeneration[bi] != cubeGeneration[bi] || snapshotMissing[bi]);
+			bool writeVoices = polyphonic && voiceGroups > 0 && (savedVoiceGeneration[bi] != cubeGeneration[bi] || snapshotMissing[bi]);
+			snapshot.voiceCount = writeVoices ? voiceGroups : 0;
+			if(snapshot.writeCube) snapshot.cube = buffers[bi];
+			for(int gi = 0; gi < snapshot.voiceCount; gi++){
+				snapshot.voiceCubes[gi] = voiceBuffers[gi][bi];
+			}
+			CubeFileHeader& header = snapshot.header;
+			header.loopSize = loopSize[bi];
+			header.frameCount = cubeExtent(bi);
+			header.generation = cubeGeneration[bi];
+		}
+
+		float* crossFades = crossFadeSnapshot->data() + CROSS_FADE_AMT * MAX_CHANNELS;
+		for(int fi = 0; fi < CROSS_FADE_AMT; fi++){
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				crossFades[fi * MAX_CHANNELS + ci] = recordCrossFadePreBuffer[ci][fi];
+			}
+		}
+
+		snapshotState.store(SNAPSHOT_TAKEN, std::memory_order_release);
+	}
+
+	//Waits for the worker thread to finish, cancelling any load in progress first if cancelLoad is set
+	void waitForCubeIO(bool cancelLoad){
+		if(cancelLoad) cancelCubeIO = true;
+		cubeIO.wait();
+		cancelCubeIO = false;
+	}
+
+	//Writes the loop of cube bi to a WAV file at the engine's sample rate, with its record boundary fades applied
+	//Only the pages are copied, the worker thread reads and writes the audio a chunk at a time
+	void exportCubeWav(int bi, std::string path){
+		waitForCubeIO(false);
+		exportBuffer = bi;
+		//Cubes are only mapped while their file is open, which this thread controls, so an open file is the only time a copy may be needed
+		if(cubeMaps[bi].isOpen()){
+			exportCopy = std::make_shared<CubeCopy<MAX_CHANNELS>>(bufferSizeMax, CUBE_FLOAT32);
+			if(!exportCopy->allocated()){
+				WARN("Cube not exported to '%s', out of memory for its copy",path.c_str());
+				exportCopy.reset();
+				return;
+			}
+		}
+		awaitAudioThread(exportState, &IceTray::takeExport);
+		//Shares ownership of the copy, its cube is what the worker reads
+		std::shared_ptr<const Cube<MAX_CHANNELS>> snapshot;
+		if(exportMapped) snapshot = std::shared_ptr<const Cube<MAX_CHANNELS>>(exportCopy, &exportCopy->cube);
+		else snapshot = std::make_shared<Cube<MAX_CHANNELS>>(exportSnapshot);
+		exportSnapshot.releasePages();
+		exportCopy.reset();
+		int frames = exportLoopSize;
+		bool fadeIn = exportFadeIn;
+		int fadeOutAt = exportFadeOutAt;
+		exportState = SNAPSHOT_IDLE;
+
+		int rate = (int)sampleRate;
+		cubeIO.push([=](){
+			if(!writeCubeWav(path, *snapshot, frames, fadeIn, fadeOutAt, rate)){
+				DEBUG("Unable to export cube to '%s'",path.c_str());
+				system::remove(path);
+			}
+		});
+	}
+
+	//Shares the pages of the cube being exported, or starts copying it when it is mapped, see stepExportCopy
+	void takeExport(){
+		copyPreRoll(PRE_ROLL_FRAMES);
+		int bi = exportBuffer;
+		exportLoopSize = loopSize[bi];
+		exportFadeIn = cubeFadeIn[bi];
+		exportFadeOutAt = cubeFadeOutAt[bi];
+		exportMapped = buffers[bi].mapped && exportCopy;
+		if(exportMapped){
+			buffers[bi].copy = exportCopy.get();
+			return;
+		}
+		//A mapped cube always has a copy, its file was open when the export started
+		if(!buffers[bi].mapped) exportSnapshot = buffers[bi];
+		exportState.store(SNAPSHOT_TAKEN, std::memory_order_release);
+	}
+
+	//Copies one page of the mapped cube being exported per sample, the export is taken once every page is copied
+	//Pages process() writes in the meantime are copied first, so the copy is the cube as it was when takeExport ran
+	void stepExportCopy(){
+		if(!exportMapped || exportState.load(std::memory_order_acquire) != SNAPSHOT_TAKING) return;
+		Cube<MAX_CHANNELS>& cube = buffers[exportBuffer];
+		//Removing the cube finishes the copy in unmap and detaches it
+		if(cube.copy == exportCopy.get() && !exportCopy->step(cube)) return;
+		cube.copy = NULL;
+		exportState.store(SNAPSHOT_TAKEN, std::memory_order_release);
+	}
+
+	bool writeCubeWav(const std::string& path, const Cube<MAX_CHANNELS>& cube, int frames, bool fadeIn, int fadeOutAt, int rate){
+		WavWriter writer;
+		if(!writer.open(path, MAX_CHANNELS, rate)) return false;
+		std::vector<float> chunk(WAV_CHUNK_FRAMES * MAX_CHANNELS);
+		for(int frame = 0; frame < frames; frame += WAV_CHUNK_FRAMES){
+			if(cancelCubeIO) break;
+			int span = std::min(WAV_CHUNK_FRAMES, frames - frame);
+			cube.readFrames(frame, chunk.data(), span);
+			for(int fi = 0; fi < span; fi++){
+				float gain = cubeFadeGain(fadeIn, fadeOutAt, frame + fi) / WAV_VOLTAGE;
+				for(int ci = 0; ci < MAX_CHANNELS; ci++){
+					chunk[fi * MAX_CHANNELS + ci] *= gain;
+				}
+			}
+			if(!writer.write(chunk.data(), span)) break;
+		}
+		return writer.close() && writer.frames == (uint32_t)frames;
+	}
+
+	//Replaces cube bi with a WAV file, resampled to the engine's sample rate and cut to the longest loop a cube holds
+	//The file is decoded on the worker thread, process() swaps it in and locks the cube against recording
+	void importCubeWav(int bi, std::string path){
+		int rate = (int)sampleRate;
+		int size = bufferSizeMax;
+		int encoding = cubeEncoding;
+		cubeIO.push([=](){
+			//An earlier import is still waiting for process(), which only happens while the engine is stopped
+			if(importReady){
+				DEBUG("Skipping import of '%s', the last import hasn't been installed yet",path.c_str());
+				return;
+			}
+			importedCube.releasePages();
+			importedCube.encoding = encoding;
+			importedCube.resize(size);
+			int frames = readCubeWav(path, importedCube, size - CROSS_FADE_AMT, rate);
+			if(frames <= 0){
+				DEBUG("Unable to import cube from '%s'",path.c_str());
+				importedCube.releasePages();
+				return;
+			}
+			importedOverview.resize(size);
+			importedOverview.include(importedCube, frames);
+			importBuffer = bi;
+			importLoopSize = frames;
+			importReady.store(true, std::memory_order_release);
+		});
+	}
+
+	//Streams a WAV file through a sample rate converter into cube, returns the number of frames written or 0 on failure
+	int readCubeWav(const std::string& path, Cube<MAX_CHANNELS>& cube, int maxFrames, int rate){
+		WavReader reader;
+		if(!reader.open(path)) return 0;
+		int frames = (int)std::min<int64_t>(maxFrames, (int64_t)reader.frames * rate / reader.sampleRate);
+
+		dsp::SampleRateConverter<MAX_CHANNELS> converter;
+		converter.setRates(reader.sampleRate, rate);
+		std::vector<float> raw(WAV_CHUNK_FRAMES * reader.channels);
+		std::vector<dsp::Frame<MAX_CHANNELS>> in(WAV_CHUNK_FRAMES);
+		std::vector<dsp::Frame<MAX_CHANNELS>> out(WAV_CHUNK_FRAMES);
+
+		int written = 0;
+		while(written < frames){
+			if(cancelCubeIO) return 0;
+			int count = reader.read(raw.data(), WAV_CHUNK_FRAMES);
+			if(count < 0) return 0;
+			if(count == 0){
+				//Past the end of the file, feed silence to flush the converter's latency
+				count = WAV_CHUNK_FRAMES;
+				std::fill(raw.begin(), raw.end(), 0.f);
+			}
+			//Mono files go to both channels, channels past the second are dropped
+			for(int fi = 0; fi < count; fi++){
+				for(int ci = 0; ci < MAX_CHANNELS; ci++){
+					in[fi].samples[ci] = raw[fi * reader.channels + std::min(ci, reader.channels - 1)] * WAV_VOLTAGE;
+				}
+			}
+			int consumed = 0;
+			while(consumed < count && written < frames){
+				int inFrames = count - consumed;
+				int outFrames = WAV_CHUNK_FRAMES;
+				converter.process(&in[consumed], &inFrames, out.data(), &outFrames);
+				if(inFrames == 0 && outFrames == 0) break;
+				consumed += inFrames;
+				int span = std::min(outFrames, frames - written);
+				//Imports are new audio, so they are refused past the cube memory limit like recordings
+				if(!cube.writeFrames(written, out[0].samples, span)) return 0;
+				written += span;
+			}
+		}
+		return written;
+	}
+
+	//Called from process(), replaces a cube with the audio importCubeWav read
+	void installImport(){
+		int bi = importBuffer;
+		//The cube was removed while the file was read
+		if(bi >= cubeCount){
+			importedCube.releasePages();
+			importReady.store(false, std::memory_order_release);
+			return;
+		}
+		//Locked so the import is played but never recorded over
+		bufferLockLevel[bi] = RECORD;
+		if(bi == recordBuffer) record_jumpToNextTrack();
+
+		//Shares the imported pages, a mapped cube copies them into its file instead
+		buffers[bi].shareFrom(importedCube, importLoopSize);
+		for(int gi = 0; gi < POLY_GROUPS; gi++){
+			voiceBuffers[gi][bi].clear();
+		}
+		if(CubeOverview* overview = overviewOf(bi)) overview->copyFrom(importedOverview);
+		loopSize[bi] = importLoopSize;
+		cubeFadeIn[bi] = false;
+		cubeFadeOutAt[bi] = -1;
+		cubeGeneration[bi]++;
+		importReady.store(false, std::memory_order_release);
+
+		if(playbackBuffer == -1) playback_jumpToNextTrack(false, false);
+		updateCubeLights();
+		updateRecordAndPlaybackLights();
+	}
+
+	std::string cubeFileName(int bi){
+		return "cube" + std::to_string(bi) + ".dat";
+	}
+
+	//Holds voices gi * 4 to gi * 4 + 3 of cube bi in polyphonic mode
+	std::string voiceCubeFileName(int bi, int gi){
+		return "cube" + std::to_string(bi) + ".voices" + std::to_string(gi) + ".dat";
+	}
+
+	//Number of frames in a cube that can hold audio, including the faded overflow past loopSize
+	int cubeExtent(int bi){
+		int extent = loopSize[bi];
+		if(bi == recordBuffer) extent = std::max(extent, (int)recordIndex + 1);
+		if(extent == 0) return 0;
+		return std::min(extent + CROSS_FADE_AMT, bufferSizeMax);
+	}
+
+	//Float channels in each frame of a cube, voice cubes hold four voices per channel
+	template <typename C>
+	static uint32_t cubeFileChannels(){
+		return MAX_CHANNELS * sizeof(typename C::Sample) / sizeof(float);
+	}
+
+	//Runs on the worker thread, only touches the snapshot, returns false if the file couldn't be written
+	//Each page is written as a chunk in header.encoding, coded losslessly unless that doesn't make it smaller
+	template <typename C>
+	static bool writeCubeFile(std::string path, CubeFileHeader header, const C& cube){
+		DEBUG("Saving cube file '%s' (%i frames)",path.c_str(),header.frameCount);
+		header.channels = cubeFileChannels<C>();
+		int pages = std::min(C::pageCount(header.frameCount), (int)cube.pages.size());
+		size_t pageBytes = C::Page::bytes(header.encoding);
+		std::string data((const char *)& header, sizeof header);
+		data.resize(CUBE_FILE_DATA_OFFSET, 0);
+		std::vector<char> page (pageBytes);
+		std::string coded;
+		for(int pi = 0; pi < pages; pi++){
+			CubeChunkHeader chunk;
+			if(cube.isSilent(pi << CUBE_PAGE_SHIFT)){
+				chunk.type = CUBE_CHUNK_SILENT;
+				chunk.size = 0;
+				data.append((const char *)& chunk, sizeof chunk);
+				continue;
+			}
+			cube.readEncoded(pi, header.encoding, page.data());
+			int frames = std::min(CUBE_PAGE_FRAMES, (int)header.frameCount - (pi << CUBE_PAGE_SHIFT));
+			coded.clear();
+			CubeCodec::compress(page.data(), header.encoding, MAX_CHANNELS, C::Page::LANES, frames, coded);
+			if(coded.size() < pageBytes){
+				chunk.type = CUBE_CHUNK_CODED;
+				chunk.size = coded.size();
+				data.append((const char *)& chunk, sizeof chunk);
+				data.append(coded);
+			}else{
+				chunk.type = CUBE_CHUNK_RAW;
+				chunk.size = pageBytes;
+				data.append((const char *)& chunk, sizeof chunk);
+				data.append(page.data(), pageBytes);
+			}
+		}
+		return writeFileAtomic(path, data.data(), data.size());
+	}
+
+	//Writes to a temporary file and renames it over path, so path always holds a complete file
+	//The temporary file sits next to path in the patch storage, which is fine because onSave waits for every write
+	static bool writeFileAtomic(std::string path, const char* data, size_t size){
+		std::string tempPath = path + ".tmp";
+		std::fstream dataFile(tempPath, ios::binary | ios::out | ios::trunc);
+		if(!dataFile.is_open()){
+			WARN("Unable to open '%s'",tempPath.c_str());
+			return false;
+		}
+		dataFile.write(data, size);
 		dataFile.close();
+		if(!dataFile || !system::rename(tempPath, path)){
+			WARN("Unable to write '%s'",path.c_str());
+			system::remove(tempPath);
+			return false;
+		}
+		return true;
+	}
+
+	//Mapped cubes already live in their file, so only the header needs updating
+	void syncMappedCube(int bi){
+		if(savedCubeGeneration[bi] == cubeGeneration[bi]) return;
+		uint32_t generation = cubeGeneration[bi];
+		CubeFileHeader* header = (CubeFileHeader*)cubeMaps[bi].data;
+		header->loopSize = loopSize[bi];
+		header->generation = generation;
+		cubeMaps[bi].flush();
+		savedCubeGeneration[bi] = generation;
+	}
+
+	//Reads interleaved frames (version 1 and legacy files) a page at a time so clearing or removing the module can cancel a long load
+	//Silent pages are left unallocated
+	bool readFrames(std::fstream & dataFile, Cube<MAX_CHANNELS> & cube, int frames){
+		std::vector<float> page (CUBE_PAGE_FRAMES * MAX_CHANNELS);
+		for(int fi = 0; fi < frames; ){
+			if(cancelCubeIO) return false;
+			int span = std::min(Cube<MAX_CHANNELS>::spanAt(fi), frames - fi);
+			dataFile.read( (char *) page.data(), span * sizeof(Frame) );
+			if(!isSilent(page.data(), span * MAX_CHANNELS)) cube.writeFrames(fi, page.data(), span, false);
+			fi += span;
+		}
+		return true;
+	}
+
+	//Reads whole planar pages (version 2 files), silent pages are left unallocated
+	//Pages keep the file's encoding until they are converted to the module's, see convertCubeEncoding
+	template <typename C>
+	bool readPages(std::fstream & dataFile, C & cube, int frames, int encoding){
+		int pages = std::min(C::pageCount(frames), (int)cube.pages.size());
+		std::vector<char> page (C::Page::bytes(encoding));
+		for(int pi = 0; pi < pages; pi++){
+			if(cancelCubeIO) return false;
+			dataFile.read( page.data(), page.size() );
+			if(!dataFile) break;
+			if(std::find_if(page.begin(), page.end(), [](char b){ return b != 0; }) != page.end()) cube.writeEncoded(pi, encoding, page.data());
+		}
+		return true;
+	}
+
+	static bool isSilent(const float* samples, int count){
+		for(int si = 0; si < count; si++){
+			if(samples[si] != 0.f) return false;
+		}
+		return true;
+	}
+
+	//Reads the header of any readable cube file, version 1 headers are given float encoding
+	//Leaves dataFile at the start of the audio
+	static bool readCubeHeader(std::fstream & dataFile, CubeFileHeader & header){
+		dataFile.read( (char *)& header, sizeof header );
+		if(!dataFile || memcmp(header.magic, CUBE_FILE_MAGIC, sizeof header.magic) != 0 || header.version > CUBE_FILE_VERSION) return false;
+		if(header.version == 1){
+			header.encoding = CUBE_FLOAT32;
+			dataFile.seekg( CUBE_FILE_V1_DATA_OFFSET, ios::beg );
+		}else{
+			dataFile.seekg( CUBE_FILE_DATA_OFFSET, ios::beg );
+		}
+		return header.encoding < CUBE_ENCODINGS;
+	}
+
+	static bool readCubeHeader(std::string path, CubeFileHeader & header){
+		std::fstream dataFile(path, ios::binary | ios::in);
+		if(!dataFile.is_open()) return false;
+		return readCubeHeader(dataFile, header) && header.channels == MAX_CHANNELS;
+	}
+
+	//Reads the page chunks of a compressed (version 3) file a page at a time, so loads stay cancellable and memory bounded
+	template <typename C>
+	bool readChunks(std::fstream & dataFile, C & cube, int fileFrames, int encoding){
+		int pages = std::min(C::pageCount(fileFrames), (int)cube.pages.size());
+		size_t pageBytes = C::Page::bytes(encoding);
+		std::vector<char> page (pageBytes);
+		std::vector<char> coded;
+		for(int pi = 0; pi < pages; pi++){
+			if(cancelCubeIO) return false;
+			CubeChunkHeader chunk;
+			dataFile.read( (char *)& chunk, sizeof chunk );
+			if(!dataFile || chunk.size > CUBE_CHUNK_SIZE_MAX) break;
+			if(chunk.type == CUBE_CHUNK_SILENT) continue;
+			coded.resize(chunk.size);
+			dataFile.read( coded.data(), chunk.size );
+			if(!dataFile) break;
+			if(chunk.type == CUBE_CHUNK_RAW && chunk.size == pageBytes){
+				cube.writeEncoded(pi, encoding, coded.data());
+			}else if(chunk.type == CUBE_CHUNK_CODED){
+				int frames = std::min(CUBE_PAGE_FRAMES, fileFrames - (pi << CUBE_PAGE_SHIFT));
+				std::fill(page.begin(), page.end(), 0);
+				if(!CubeCodec::decompress(coded.data(), coded.size(), encoding, MAX_CHANNELS, C::Page::LANES, frames, page.data())){
+					DEBUG("Cube page %i is corrupt",pi);
+					break;
+				}
+				cube.writeEncoded(pi, encoding, page.data());
+			}else{
+				break;
+			}
+		}
+		return true;
+	}
+
+	//Only stereo cubes were ever saved as version 1
+	bool readVersion1Frames(std::fstream & dataFile, Cube<MAX_CHANNELS> & cube, int frames){
+		return readFrames(dataFile, cube, frames);
+	}
+
+	template <typename C>
+	bool readVersion1Frames(std::fstream & dataFile, C & cube, int frames){
+		return false;
+	}
+
+	//Reads the audio after a cube file header of any version
+	template <typename C>
+	bool readCubeAudio(std::fstream & dataFile, const CubeFileHeader & header, C & cube){
+		int frames = std::min((int)header.frameCount, cube.size);
+		if(header.version == 1) return readVersion1Frames(dataFile, cube, frames);
+		if(header.version == 2) return readPages(dataFile, cube, frames, header.encoding);
+		return readChunks(dataFile, cube, header.frameCount, header.encoding);
+	}
+
+	//Reads a version 1 or compressed cube file into cube, returns false if path isn't one
+	bool readUnmappableCube(std::string path, Cube<MAX_CHANNELS> & cube, int size){
+		std::fstream dataFile(path, ios::binary | ios::in);
+		if(!dataFile.is_open()) return false;
+		CubeFileHeader header;
+		if(!readCubeHeader(dataFile, header) || header.version == CUBE_FILE_MAPPED_VERSION || header.channels != MAX_CHANNELS) return false;
+		cube.resize(size);
+		return readCubeAudio(dataFile, header, cube);
+	}
+
+	void loadCube(std::string path, int bi){
+		std::fstream dataFile(path, ios::binary | ios::in);
+		if(!dataFile.is_open()){
+			DEBUG("Unable to open cube file '%s'",path.c_str());
+			return;
+		}
+
+		CubeFileHeader header;
+		if(!readCubeHeader(dataFile, header) || header.channels != MAX_CHANNELS){
+			DEBUG("Cube file '%s' is not a version %i cube file",path.c_str(),CUBE_FILE_VERSION);
+			return;
+		}
+
+		buffers[bi].clear();
+		if(!readCubeAudio(dataFile, header, buffers[bi])) return;
+		dataFile.close();
+
+		//The file matches memory, so there is nothing to write until the cube changes
+		cubeGeneration[bi] = header.generation;
+		savedCubeGeneration[bi] = header.generation;
+	}
+
+	//Voice cube files are never version 1, a missing group just stays silent
+	void loadVoiceCubes(std::string dir, int bi){
+		for(int gi = 0; gi < voiceGroups; gi++){
+			std::string path = system::join(dir, voiceCubeFileName(bi, gi));
+			std::fstream dataFile(path, ios::binary | ios::in);
+			if(!dataFile.is_open()) continue;
+
+			CubeFileHeader header;
+			if(!readCubeHeader(dataFile, header) || header.version < 2 || header.channels != cubeFileChannels<Cube<MAX_CHANNELS, simd::float_4>>()){
+				DEBUG("Cube file '%s' is not a version %i voice cube file",path.c_str(),CUBE_FILE_VERSION);
+				continue;
+			}
+
+			voiceBuffers[gi][bi].clear();
+			if(!readCubeAudio(dataFile, header, voiceBuffers[gi][bi])) return;
+			savedVoiceGeneration[bi] = header.generation;
+		}
+	}
+
+	void loadCrossFades(std::string path){
+		std::fstream dataFile(path, ios::binary | ios::in);
+		if(!dataFile.is_open()) return;
+		//Skip the pre-rendered playback cross fade older versions saved
+		dataFile.seekg( CROSS_FADE_AMT * MAX_CHANNELS * sizeof(float), ios::cur );
+		readPreBuffer(dataFile);
+		dataFile.close();
+	}
+
+	//The pre-record buffer is saved interleaved
+	void readPreBuffer(std::fstream & dataFile){
+		std::vector<float> frames (CROSS_FADE_AMT * MAX_CHANNELS);
+		dataFile.read( (char *) frames.data(), frames.size() * sizeof(float) );
+		if(!dataFile) return;
+		for(int fi = 0; fi < CROSS_FADE_AMT; fi++){
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				recordCrossFadePreBuffer[ci][fi] = frames[fi * MAX_CHANNELS + ci];
+			}
+		}
+	}
+
+	//Reads the old single buffers.dat format, every cube is rewritten as a cube file on the next save
+	void loadLegacyBuffers(std::string path){
+		DEBUG("Reading legacy data file '%s' ",path.c_str());
+		std::fstream dataFile(path, ios::binary | ios::in);
+		if (dataFile.is_open())
+		{
+			int readSize = std::min(LEGACY_BUFFER_SIZE_MAX, bufferSizeMax);
+			for(int bi = 0; bi < LEGACY_CUBE_COUNT; bi++){
+				if(bi >= cubeCount){
+					dataFile.seekg( LEGACY_BUFFER_SIZE_MAX * sizeof(Frame), ios::cur );
+					continue;
+				}
+				buffers[bi].clear();
+				if(!readFrames(dataFile, buffers[bi], readSize)) return;
+				dataFile.seekg( (LEGACY_BUFFER_SIZE_MAX - readSize) * sizeof(Frame), ios::cur );
+				cubeGeneration[bi]++;
+			}
+			dataFile.seekg( CROSS_FADE_AMT * MAX_CHANNELS * sizeof(float), ios::cur );
+			readPreBuffer(dataFile);
+			dataFile.close();
+		}
+		else
+		{
+			DEBUG("Unable to open data file");
+		}
 	}
 
 	json_t *dataToJson() override {
@@ -437,13 +1465,15 @@ struct IceTray : Module {
 
 		json_object_set_new(rootJ, "version", json_string("2.1.0"));
 
-		for(int bi = 0; bi < BUFFER_COUNT; bi++){
+		json_object_set_new(rootJ, "cubeCount", json_integer(cubeCount));
+		for(int bi = 0; bi < cubeCount; bi++){
 			std::string bis = std::to_string(bi);
 			json_object_set_new(rootJ, std::string("bufferLockLevel." + bis).c_str(), json_integer(bufferLockLevel[bi]));
 			json_object_set_new(rootJ, std::string("loopSize." + bis).c_str(), json_integer(loopSize[bi]));
+			json_object_set_new(rootJ, std::string("fadeIn." + bis).c_str(), json_bool(cubeFadeIn[bi]));
+			json_object_set_new(rootJ, std::string("fadeOutAt." + bis).c_str(), json_integer(cubeFadeOutAt[bi]));
 		}
 
-		json_object_set_new(rootJ, "playbackCrossFadeBufferIndex" , json_integer(playbackCrossFadeBufferIndex));
 		json_object_set_new(rootJ, "recordCrossFadePreBufferIndex" , json_integer(recordCrossFadePreBufferIndex));
 
 		json_object_set_new(rootJ, "recordIndex" , json_real(recordIndex));
@@ -464,20 +1494,36 @@ struct IceTray : Module {
 		json_object_set_new(rootJ, "prevInput.1" , json_real(prevInput[1]));
 		json_object_set_new(rootJ, "fadeInStart" , json_integer(fadeInStart));
 
-		json_object_set_new(rootJ, "pitchCorrectionOn" , json_bool(pitchCorrectionOn));
+		json_object_set_new(rootJ, "pitchCorrection" , json_integer(pitchCorrection));
+		//Kept for older versions, which only know the spectral engine
+		json_object_set_new(rootJ, "pitchCorrectionOn" , json_bool(pitchCorrection != PITCH_CORRECTION_OFF));
+		json_object_set_new(rootJ, "mapCubes" , json_bool(mapCubes));
+		json_object_set_new(rootJ, "polyphonic" , json_bool(polyphonic));
+		json_object_set_new(rootJ, "voiceGroups" , json_integer(voiceGroups));
+		json_object_set_new(rootJ, "cubeEncoding" , json_integer(cubeEncoding));
+		json_object_set_new(rootJ, "cubeCompression" , json_integer(cubeCompression));
 
 		return rootJ;
 	}
 
 	void dataFromJson(json_t *rootJ) override {
 
-		for(int bi = 0; bi < BUFFER_COUNT; bi++){
+		//Patches from before the count could be changed have six cubes
+		json_t* cubeCountJ = json_object_get(rootJ, "cubeCount");
+		int count = clamp(cubeCountJ ? (int)json_integer_value(cubeCountJ) : LEGACY_CUBE_COUNT, CUBE_COUNT_MIN, CUBE_COUNT_MAX);
+		readPatterns.reserve(count);
+		//Before onAdd the cubes have no storage and process() isn't running, afterwards (presets) process() resizes them
+		if(bufferSizeMax == 0) setCubeCount(count);
+		else cubeCountRequested = count;
+		for(int bi = 0; bi < count; bi++){
 			std::string bis = std::to_string(bi);
 			bufferLockLevel[bi] = (LockLevel)json_integer_value(json_object_get(rootJ, std::string("bufferLockLevel." + bis).c_str()));
 			loopSize[bi] = json_integer_value(json_object_get(rootJ, std::string("loopSize." + bis).c_str()));
+			cubeFadeIn[bi] = json_is_true(json_object_get(rootJ, std::string("fadeIn." + bis).c_str()));
+			json_t* fadeOutAtJ = json_object_get(rootJ, std::string("fadeOutAt." + bis).c_str());
+			cubeFadeOutAt[bi] = fadeOutAtJ ? json_integer_value(fadeOutAtJ) : -1;
 		}
 
-		playbackCrossFadeBufferIndex = json_integer_value(json_object_get(rootJ, "playbackCrossFadeBufferIndex"));
 		recordCrossFadePreBufferIndex = json_integer_value(json_object_get(rootJ, "recordCrossFadePreBufferIndex"));
 
 		recordIndex = json_real_value(json_object_get(rootJ, "recordIndex"));
@@ -498,11 +1544,74 @@ struct IceTray : Module {
 		prevInput[1] = json_real_value(json_object_get(rootJ, "prevInput.1"));
 		fadeInStart = json_integer_value(json_object_get(rootJ, "fadeInStart"));
 
-		pitchCorrectionOn = json_is_true(json_object_get(rootJ, "pitchCorrectionOn"));
+		json_t* pitchCorrectionJ = json_object_get(rootJ, "pitchCorrection");
+		if(pitchCorrectionJ){
+			pitchCorrection = clamp((int)json_integer_value(pitchCorrectionJ), (int)PITCH_CORRECTION_OFF, (int)PITCH_CORRECTION_SPECTRAL);
+		}else{
+			pitchCorrection = json_is_true(json_object_get(rootJ, "pitchCorrectionOn")) ? PITCH_CORRECTION_SPECTRAL : PITCH_CORRECTION_OFF;
+		}
+		mapCubes = json_is_true(json_object_get(rootJ, "mapCubes"));
+		polyphonic = json_is_true(json_object_get(rootJ, "polyphonic"));
+		voiceGroups = clamp((int)json_integer_value(json_object_get(rootJ, "voiceGroups")), 0, POLY_GROUPS);
+		cubeEncoding = clamp((int)json_integer_value(json_object_get(rootJ, "cubeEncoding")), (int)CUBE_FLOAT32, CUBE_ENCODINGS - 1);
+		cubeCompression = clamp((int)json_integer_value(json_object_get(rootJ, "cubeCompression")), (int)CUBE_COMPRESSION_LOSSLESS, (int)CUBE_COMPRESSION_LOSSY);
+		reserveCubePages();
+	}
+
+	void processBypass(const ProcessArgs& args) override {
+		ProcessGuard guard(this);
+		if(!guard.entered) return;
+		CubePagePool::realtime() = true;
+		//A bypassed module can still be saved
+		serviceSnapshotRequests();
+		Module::processBypass(args);
 	}
 
 	void process(const ProcessArgs& args) override {
-		for(int bi = 0; bi < BUFFER_COUNT; bi++){
+		//Another thread is taking a snapshot while the engine stalled, leave the cubes alone until it is done
+		ProcessGuard guard(this);
+		if(!guard.entered) return;
+		//Cube pages written from here come from the page pool
+		CubePagePool::realtime() = true;
+
+		//Cubes are still being read by the worker thread, pass audio through until they are ready
+		if(cubesLoading.load(std::memory_order_acquire)){
+			if(polyphonic){
+				for(int ci = 0; ci < MAX_CHANNELS; ci++){
+					Input& in = inputs[LEFT_INPUT + ci];
+					Output& out = outputs[LEFT_OUTPUT + ci];
+					out.setChannels(in.getChannels());
+					for(int vi = 0; vi < in.getChannels(); vi++) out.setVoltage(in.getVoltage(vi), vi);
+				}
+			}else{
+				outputs[LEFT_OUTPUT].setVoltage(inputs[LEFT_INPUT].getVoltageSum());
+				outputs[RIGHT_OUTPUT].setVoltage(inputs[RIGHT_INPUT].getVoltageSum());
+			}
+			return;
+		}
+
+		serviceSnapshotRequests();
+
+		if(clearCubesRequested){
+			clearCubesRequested = false;
+			clearCubes();
+		}
+
+		if(cubeCountRequested){
+			setCubeCount(cubeCountRequested.exchange(0));
+			//Recording and playback move on if their cube was removed
+			if(recordBuffer == -1) record_jumpToNextTrack();
+			else if(playbackBuffer == -1) playback_jumpToNextTrack(false, false);
+			updateCubeLights();
+			updateRecordAndPlaybackLights();
+		}
+
+		if(importReady.load(std::memory_order_acquire)) installImport();
+
+		if(buffers[0].encoding != cubeEncoding) setCubeEncoding(cubeEncoding);
+		if(encodingPending) convertCubeEncoding();
+
+		for(int bi = 0; bi < std::min(cubeCount, PANEL_CUBE_COUNT); bi++){
 			bool button = params[CUBE_SWITCH_PARAM + bi].getValue() > 0;
 			if(!cubeButtonDown[bi] && button){
 				cubeButtonDown[bi] = true;
@@ -532,7 +1641,7 @@ struct IceTray : Module {
 		}
 
 		float bufferLengthSeconds = inputs[CLOCK_RECORD_INPUT].isConnected() ? BUFFER_LENGTH_SECONDS_KNOB_MAX : params[RECORD_LENGTH_PARAM].getValue();
-		int bufferLength = round(ASSUMED_SAMPLE_RATE * bufferLengthSeconds);
+		int bufferLength = round(sampleRate * bufferLengthSeconds);
 
 		float recordClock = inputs[CLOCK_RECORD_INPUT].getVoltage();
 		if (!recordClockHigh && recordClock > 2.0f) {
@@ -565,85 +1674,158 @@ struct IceTray : Module {
 		feedbackValue[0] *= feedbackScalar;
 		feedbackValue[1] *= feedbackScalar;
 
-		float rawInput [MAX_CHANNELS] = {inputs[LEFT_INPUT].getVoltageSum(), inputs[RIGHT_INPUT].getVoltageSum()};
 		bool inputConnected [MAX_CHANNELS] = {inputs[LEFT_INPUT].isConnected(), inputs[RIGHT_INPUT].isConnected()};
 
-		float pitchShiftedInput [MAX_CHANNELS] = {0,0};
-
-		for(int ci = 0; ci < MAX_CHANNELS; ci++){
-			if(!inputConnected[ci]) continue;
+		//Polyphonic voices, a mono input is copied to every voice
+		int voices = polyphonic ? clamp(std::max(inputs[LEFT_INPUT].getChannels(), inputs[RIGHT_INPUT].getChannels()), 1, POLY_CHANNELS) : 0;
+		int groups = (voices + 3) / 4;
+		simd::float_4 voiceInput [POLY_GROUPS][MAX_CHANNELS];
+		simd::float_4 voiceSlope [POLY_GROUPS][MAX_CHANNELS];
+		for(int gi = 0; gi < groups; gi++){
+			simd::float_4 rawVoices [MAX_CHANNELS];
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				rawVoices[ci] = inputConnected[ci] ? inputs[LEFT_INPUT + ci].getPolyVoltageSimd<simd::float_4>(gi * 4) : 0.f;
+				voiceFeedback[gi][ci] *= feedbackScalar;
+			}
+			if(pitchCorrection != PITCH_CORRECTION_OFF){
+				voiceGrainShifter[gi].process(speedInvert, rawVoices, voiceInput[gi]);
+			}else{
+				voiceInput[gi][0] = rawVoices[0];
+				voiceInput[gi][1] = rawVoices[1];
+			}
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				voiceInput[gi][ci] += voiceFeedback[gi][ci];
+				voiceSlope[gi][ci] = (voiceInput[gi][ci] - voicePrevInput[gi][ci]) / speedInvert;
+			}
+		}
+		if(groups > voiceGroups) voiceGroups = groups;
 
-			if(pitchCorrectionOn){
-				in_Buffer[ci].push(rawInput[ci] / 10.0f);
+		float rawInput [MAX_CHANNELS] = {0,0};
+		if(!polyphonic){
+			rawInput[0] = inputs[LEFT_INPUT].getVoltageSum();
+			rawInput[1] = inputs[RIGHT_INPUT].getVoltageSum();
+		}
 
-				if (in_Buffer[ci].full()) {
-					pShifter[ci]->process(speedInvert, in_Buffer[ci].startData(), ps_Buffer[ci].endData());
-					ps_Buffer[ci].endIncr(PITCH_BUFF_SIZE);
-					in_Buffer[ci].clear();
-				}
+		float pitchShiftedInput [MAX_CHANNELS] = {0,0};
 
-				if (ps_Buffer[ci].size() > 0) {
-					pitchShiftedInput[ci] = *ps_Buffer[ci].startData() * 6.6f;
-					ps_Buffer[ci].startIncr(1);
-				}
-			}else{
-				pitchShiftedInput[ci] = rawInput[ci];
+		if(polyphonic){
+			//The voices were shifted above
+		}else if(pitchCorrection == PITCH_CORRECTION_SPECTRAL && (inputConnected[0] || inputConnected[1])){
+			//Both channels are shifted together, a disconnected one just carries silence
+			float shifterInput [MAX_CHANNELS] = {rawInput[0] / 10.0f, rawInput[1] / 10.0f};
+			float shifterOutput [MAX_CHANNELS];
+			pShifter->process(speedInvert, shifterInput, shifterOutput);
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				if(inputConnected[ci]) pitchShiftedInput[ci] = shifterOutput[ci] * 6.6f;
+			}
+		}else if(pitchCorrection == PITCH_CORRECTION_TIME_DOMAIN && (inputConnected[0] || inputConnected[1])){
+			float shifterOutput [MAX_CHANNELS];
+			grainShifter.process(speedInvert, rawInput, shifterOutput);
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				if(inputConnected[ci]) pitchShiftedInput[ci] = shifterOutput[ci];
+			}
+		}else if(pitchCorrection == PITCH_CORRECTION_OFF){
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				if(inputConnected[ci]) pitchShiftedInput[ci] = rawInput[ci];
 			}
 		}
 
 		float input [MAX_CHANNELS] = {pitchShiftedInput[0] + feedbackValue[0], pitchShiftedInput[1] + feedbackValue[1]};
 
 		int steps = floor(speedInvert);
+		//Each input sample is stretched over steps + 1 frames, interpolated from the previous input
+		//The frames are written as contiguous spans so slow speeds don't pay per frame overhead
+		float slope [MAX_CHANNELS] = {(input[0] - prevInput[0]) / speedInvert, (input[1] - prevInput[1]) / speedInvert};
+		//Before the pre record buffer is written over, it moves on as fast as the record head so steps + 1 frames keep the copy ahead
+		copyPreRoll(std::max(PRE_ROLL_CHUNK, steps + 1));
 		//Pre Record Buffer Record
 		{
 			int low = floor(recordCrossFadePreBufferIndex);
 			recordCrossFadePreBufferIndex += speedInvert;
 			if(recordCrossFadePreBufferIndex >= CROSS_FADE_AMT) recordCrossFadePreBufferIndex -= CROSS_FADE_AMT;
 
-			for(int d = 0; d <= steps; d++){
-
+			for(int d = 0; d <= steps; ){
 				int ri = low + d;
-				float percent = d / speedInvert;
-				float writeVal0 = prevInput[0] * (1-percent) + input[0] * percent;
-				float writeVal1 = prevInput[1] * (1-percent) + input[1] * percent;
-
-				recordCrossFadePreBuffer[ri][0] = writeVal0;
-				recordCrossFadePreBuffer[ri][1] = writeVal1;
-				ri++;
-				if(ri >= CROSS_FADE_AMT){
-					low -= CROSS_FADE_AMT;
+				if(ri >= CROSS_FADE_AMT) ri -= CROSS_FADE_AMT;
+				int span = std::min(steps + 1 - d, CROSS_FADE_AMT - ri);
+				for(int ci = 0; ci < MAX_CHANNELS; ci++){
+					if(!polyphonic) writeRamp(&recordCrossFadePreBuffer[ci][ri], span, prevInput[ci], slope[ci], d);
+					for(int gi = 0; gi < groups; gi++){
+						writeRamp(&voicePreBuffer[gi][ci][ri], span, voicePrevInput[gi][ci], voiceSlope[gi][ci], d);
+					}
 				}
-			}			
+				d += span;
+			}
 		}
 
 		//Main Buffer Record
 		if(recordBuffer >= 0){
 			int low = floor(recordIndex);			
 			recordIndex += speedInvert; //Do this before the loop so if record_jumpToNextTrack gets called, it overrides this value
-			for(int d = 0; d <= steps; d++){
-
-				int ri = low + d;
-				float percent = d / speedInvert;
-				float writeVal0 = prevInput[0] * (1-percent) + input[0] * percent;
-				float writeVal1 = prevInput[1] * (1-percent) + input[1] * percent;
-
-				buffers[recordBuffer][ri][0] = writeVal0;
-				buffers[recordBuffer][ri][1] = writeVal1;
-				ri++;
-				if(ri >= bufferLength){
-					record_jumpToNextTrack();
-					break;
-					//low = floor(recordIndex) - d;
+			cubeGeneration[recordBuffer]++;
+			//Stop at the end of the cube, at least one frame is always written
+			int count = std::max(1, std::min(steps + 1, bufferLength - low));
+			//A ramp's peaks are its ends, so the overview costs the same however many frames were written
+			float peakLow = 0.f;
+			float peakHigh = 0.f;
+			bool written = true;
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				if(!polyphonic){
+					written &= recordRamp(buffers[recordBuffer], ci, low, count, prevInput[ci], slope[ci]);
+					float end = prevInput[ci] + slope[ci] * (count - 1);
+					peakLow = std::min(peakLow, std::min(prevInput[ci], end));
+					peakHigh = std::max(peakHigh, std::max(prevInput[ci], end));
+				}
+				for(int gi = 0; gi < groups; gi++){
+					written &= recordRamp(voiceBuffers[gi][recordBuffer], ci, low, count, voicePrevInput[gi][ci], voiceSlope[gi][ci]);
+					simd::float_4 end = voicePrevInput[gi][ci] + voiceSlope[gi][ci] * (float)(count - 1);
+					simd::float_4 rampLow = simd::fmin(voicePrevInput[gi][ci], end);
+					simd::float_4 rampHigh = simd::fmax(voicePrevInput[gi][ci], end);
+					for(int li = 0; li < 4; li++){
+						peakLow = std::min(peakLow, rampLow[li]);
+						peakHigh = std::max(peakHigh, rampHigh[li]);
+					}
 				}
-			}			
+			}
+			if(CubeOverview* overview = overviewOf(recordBuffer)) overview->record(low, count, peakLow, peakHigh);
+			//A page refused by the cube memory limit ends the recording here, record_jumpToNextTrack then waits for memory
+			//Pages dropped only because the pool ran dry leave a short silence and recording carries on
+			if(low + count >= bufferLength || (!written && cubeMemoryFull())){
+				record_jumpToNextTrack();
+			}
 		}
 
 		prevInput[0] = input[0];
 		prevInput[1] = input[1];
+		for(int gi = 0; gi < groups; gi++){
+			voicePrevInput[gi][0] = voiceInput[gi][0];
+			voicePrevInput[gi][1] = voiceInput[gi][1];
+		}
+
+		//Mixed before the playhead moves, so a voice started by this sample's jump begins on the next sample
+		float fadeOutput [MAX_CHANNELS] = {0,0};
+		simd::float_4 voiceOutput [POLY_GROUPS][MAX_CHANNELS] = {};
+		if(polyphonic){
+			for(int gi = 0; gi < groups; gi++){
+				mixFadeVoices(voiceOutput[gi][0], voiceOutput[gi][1], voiceBuffers[gi]);
+			}
+		}else{
+			mixFadeVoices(fadeOutput[0], fadeOutput[1], buffers);
+		}
+		advanceFadeVoices();
 
 		float output [MAX_CHANNELS] = {0,0};
 		if(playbackBuffer >= 0){
-			getPlaybackOuput(output[0],output[1],playbackIndex);
+			if(polyphonic){
+				for(int gi = 0; gi < groups; gi++){
+					simd::float_4 out0, out1;
+					getPlaybackOuput(out0, out1, voiceBuffers[gi], playbackBuffer, loopSize[playbackBuffer], fadeInStart, playbackIndex);
+					voiceOutput[gi][0] += out0;
+					voiceOutput[gi][1] += out1;
+				}
+			}else{
+				getPlaybackOuput(output[0],output[1],playbackIndex);
+			}
 			playbackIndex++;
 
 			if(params[PLAYBACK_MODE_PARAM].getValue() == 1){
@@ -656,47 +1838,75 @@ struct IceTray : Module {
 			}
 		}
 
-		if(playbackCrossFadeBufferIndex < CROSS_FADE_AMT){
-			float crossOut0 = playbackCrossFadeBuffer[playbackCrossFadeBufferIndex][0];
-			float crossOut1 = playbackCrossFadeBuffer[playbackCrossFadeBufferIndex][1];
-			output[0] += crossOut0;
-			output[1] += crossOut1;
-			playbackCrossFadeBufferIndex++;
+		if(polyphonic){
+			outputVoices(voiceOutput, voices);
+			return;
 		}
 
-		for(int ci = 0; ci < MAX_CHANNELS; ci++){
-			if(std::isnan(output[ci])) output[ci] = 0;
-			lowpassFilter[ci].process(output[ci]);
-			output[ci] = lowpassFilter[ci].lowpass();
-			highpassFilter[ci].process(output[ci]);
-			output[ci] = highpassFilter[ci].highpass();
-		}
+		output[0] += fadeOutput[0];
+		output[1] += fadeOutput[1];
+
+		simd::float_4 filtered = simd::float_4(output[0], output[1], 0.f, 0.f);
+		filtered = simd::ifelse(filtered != filtered, simd::float_4(0.f), filtered);
+		lowpassFilter.process(filtered);
+		filtered = lowpassFilter.lowpass();
+		highpassFilter.process(filtered);
+		filtered = highpassFilter.highpass();
+		output[0] = filtered[0];
+		output[1] = filtered[1];
 		outputs[LEFT_OUTPUT].setVoltage(output[0]);
 		outputs[RIGHT_OUTPUT].setVoltage(output[1]);
 		feedbackValue[0] = output[0];
 		feedbackValue[1] = output[1];
 	}
 
+	//Filters the voices and sets the polyphonic outputs, the filtered output is also the next feedback
+	void outputVoices(simd::float_4 voiceOutput [POLY_GROUPS][MAX_CHANNELS], int voices){
+		for(int ci = 0; ci < MAX_CHANNELS; ci++){
+			outputs[LEFT_OUTPUT + ci].setChannels(voices);
+		}
+		for(int gi = 0; gi * 4 < voices; gi++){
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				simd::float_4 filtered = voiceOutput[gi][ci];
+				filtered = simd::ifelse(filtered != filtered, simd::float_4(0.f), filtered);
+				voiceLowpassFilter[gi][ci].process(filtered);
+				filtered = voiceLowpassFilter[gi][ci].lowpass();
+				voiceHighpassFilter[gi][ci].process(filtered);
+				filtered = voiceHighpassFilter[gi][ci].highpass();
+				outputs[LEFT_OUTPUT + ci].setVoltageSimd(filtered, gi * 4);
+				voiceFeedback[gi][ci] = filtered;
+			}
+		}
+	}
+
 	void onSampleRateChange(const SampleRateChangeEvent& e) override {
-		pShifter[0]->cleanup();
-		pShifter[1]->cleanup();
+		allocateCubes(e.sampleRate);
 
-		pShifter[0]->init(PITCH_BUFF_SIZE, 8, e.sampleRate);
-		pShifter[1]->init(PITCH_BUFF_SIZE, 8, e.sampleRate);
+		pShifter->cleanup();
+		pShifter->init(PITCH_BUFF_SIZE, 8, e.sampleRate);
+		grainShifter.init(GRAIN_SECONDS, e.sampleRate);
+		for(int gi = 0; gi < POLY_GROUPS; gi++){
+			voiceGrainShifter[gi].init(GRAIN_SECONDS, e.sampleRate);
+		}
 
-		lowpassFilter[0].setCutoff(20000 / e.sampleRate);
-		lowpassFilter[1].setCutoff(20000 / e.sampleRate);
-		highpassFilter[0].setCutoff(20 / e.sampleRate);
-		highpassFilter[1].setCutoff(20 / e.sampleRate);
+		lowpassFilter.setCutoff(20000 / e.sampleRate);
+		highpassFilter.setCutoff(20 / e.sampleRate);
+		setVoiceFilterCutoffs(e.sampleRate);
 	}
 
 	void getPlaybackOuput(float & out0, float & out1, int index){
-		int ls = loopSize[playbackBuffer];		
+		getPlaybackOuput(out0, out1, buffers, playbackBuffer, loopSize[playbackBuffer], fadeInStart, index);
+	}
+
+	//T is float for the stereo cubes or simd::float_4 for a group of voice cubes
+	template <typename T>
+	void getPlaybackOuput(T & out0, T & out1, const Cube<MAX_CHANNELS, T>* cubes, int buffer, int ls, int fadeInStart, int index){
 		int pbi = index;
 
 		while(pbi > ls) pbi -= ls;
-		float o0 = buffers[playbackBuffer][pbi][0];
-		float o1 = buffers[playbackBuffer][pbi][1];
+		float cubeGain = getCubeFadeGain(buffer, pbi);
+		T o0 = cubes[buffer].read(0, pbi) * cubeGain;
+		T o1 = cubes[buffer].read(1, pbi) * cubeGain;
 
 		//Note toStart is calclauted two ways:
 		//1. before wrapping
@@ -723,10 +1933,102 @@ struct IceTray : Module {
 		out1 = o1;
 	}
 
+	//Returns true if the plugin's cube memory limit refuses the next page recording would need
+	bool cubeMemoryFull(){
+		int64_t pageBytes = polyphonic ? Cube<MAX_CHANNELS, simd::float_4>::Page::bytes(cubeEncoding) : Cube<MAX_CHANNELS>::Page::bytes(cubeEncoding);
+		return !cubeBudget().fits(pageBytes);
+	}
+
+	//Returns true if the plugin's cube memory budget has room for the longest recording into cube bi
+	//Pages the cube already holds by itself are recorded over in place, so they don't count
+	bool recordingFits(int bi){
+		int pages = Cube<MAX_CHANNELS>::pageCount(bufferSizeMax);
+		int64_t need = 0;
+		if(!polyphonic){
+			if(buffers[bi].mapped) return true;
+			need = (int64_t)pages * Cube<MAX_CHANNELS>::Page::bytes(cubeEncoding) - buffers[bi].ownedBytes();
+		}else{
+			for(int gi = 0; gi < std::max(voiceGroups, 1); gi++){
+				need += (int64_t)pages * Cube<MAX_CHANNELS, simd::float_4>::Page::bytes(cubeEncoding) - voiceBuffers[gi][bi].ownedBytes();
+			}
+		}
+		return cubeBudget().fits(need);
+	}
+
+	//Rebuilds a cube's overview from its audio, O(frames) so only used when a cube changes in bulk
+	void rebuildOverview(int bi){
+		CubeOverview* overview = overviewOf(bi);
+		if(!overview) return;
+		int frames = cubeExtent(bi);
+		overview->resize(bufferSizeMax);
+		overview->include(buffers[bi], frames);
+		for(int gi = 0; gi < voiceGroups; gi++){
+			overview->include(voiceBuffers[gi][bi], frames);
+		}
+	}
+
+	//Copies the next frames of the pre-roll to the start of the record cube, oldest frame first, its fade in is applied on playback
+	//record_jumpToNextTrack only marks the pre-roll to copy, so a jump doesn't write a whole cross fade of frames in one sample
+	void copyPreRoll(int frames){
+		if(recordBuffer < 0 || preRollCopied >= PRE_ROLL_FRAMES) return;
+		int first = preRollCopied;
+		int end = std::min(first + frames, PRE_ROLL_FRAMES);
+		float peakLow = 0.f;
+		float peakHigh = 0.f;
+		while(preRollCopied < end){
+			int ri = preRollOldest + preRollCopied;
+			if(ri >= CROSS_FADE_AMT) ri -= CROSS_FADE_AMT;
+			int span = std::min(end - preRollCopied, CROSS_FADE_AMT - ri);
+			for(int ci = 0; ci < MAX_CHANNELS; ci++){
+				if(!polyphonic){
+					buffers[recordBuffer].writeSamples(ci, preRollCopied, &recordCrossFadePreBuffer[ci][ri], span);
+					for(int fi = ri; fi < ri + span; fi++){
+						peakLow = std::min(peakLow, recordCrossFadePreBuffer[ci][fi]);
+						peakHigh = std::max(peakHigh, recordCrossFadePreBuffer[ci][fi]);
+					}
+				}
+				for(int gi = 0; polyphonic && gi < voiceGroups; gi++){
+					voiceBuffers[gi][recordBuffer].writeSamples(ci, preRollCopied, &voicePreBuffer[gi][ci][ri], span);
+					simd::float_4 voiceLow = 0.f;
+					simd::float_4 voiceHigh = 0.f;
+					for(int fi = ri; fi < ri + span; fi++){
+						voiceLow = simd::fmin(voiceLow, voicePreBuffer[gi][ci][fi]);
+						voiceHigh = simd::fmax(voiceHigh, voicePreBuffer[gi][ci][fi]);
+					}
+					for(int li = 0; li < 4; li++){
+						peakLow = std::min(peakLow, voiceLow[li]);
+						peakHigh = std::max(peakHigh, voiceHigh[li]);
+					}
+				}
+			}
+			preRollCopied += span;
+		}
+		if(CubeOverview* overview = overviewOf(recordBuffer)) overview->widen(first, end - first, peakLow, peakHigh);
+	}
+
+	//Gain of the record boundary fades at frame i of a cube
+	//Fades in over the start and dips to 0 at cubeFadeOutAt, so loop ends and overflow don't click
+	float getCubeFadeGain(int bi, int i){
+		return cubeFadeGain(cubeFadeIn[bi], cubeFadeOutAt[bi], i);
+	}
+
+	static float cubeFadeGain(bool fadeIn, int fadeOutAt, int i){
+		float gain = 1.f;
+		if(fadeIn && i < CROSS_FADE_AMT){
+			gain = (float)i/CROSS_FADE_AMT;
+		}
+		if(fadeOutAt >= 0){
+			int toEnd = std::abs(i - fadeOutAt);
+			if(toEnd < CROSS_FADE_AMT) gain *= (float)toEnd/CROSS_FADE_AMT;
+		}
+		return gain;
+	}
+
 	void updateCubeLights(){
-		for(int i = 0; i < 6; i++){
+		for(int i = 0; i < PANEL_CUBE_COUNT; i++){
 			float brightness;
-			switch(bufferLockLevel[i]){
+			//Panel cubes past the count stay dark
+			switch(i < cubeCount ? bufferLockLevel[i] : ALL){
 				case NONE:
 					brightness = 1.f;
 					break;
@@ -743,7 +2045,7 @@ struct IceTray : Module {
 	}
 
 	void updateRecordAndPlaybackLights(){
-		for(int i = 0; i < BUFFER_COUNT; i++){
+		for(int i = 0; i < PANEL_CUBE_COUNT; i++){
 			lights[RP_LIGHT + i * 3 + 0].setBrightness(i == recordBuffer ? 1.f : 0);
 			lights[RP_LIGHT + i * 3 + 1].setBrightness(i == playbackBuffer ? 1.f : 0);
 		}
@@ -751,52 +2053,62 @@ struct IceTray : Module {
 
 	void record_jumpToNextTrack() {
 		if(recordBuffer != -1){
-			loopSize[recordBuffer] = clamp((int)recordIndex, 0, BUFFER_SIZE_MAX-CROSS_FADE_AMT);
-
-			//Cross fade out the tail end of the current buffer
-			for(int ci = 0; ci < CROSS_FADE_AMT; ci++){
-				int i = loopSize[recordBuffer] - ci;
-				if(i >= 0){
-					float scalar = (float)ci/CROSS_FADE_AMT;
-					buffers[recordBuffer][i][0] *= scalar;
-					buffers[recordBuffer][i][1] *= scalar;
+			//A cube shorter than its pre-roll closes before the copy catches up
+			copyPreRoll(PRE_ROLL_FRAMES);
+			loopSize[recordBuffer] = clamp((int)recordIndex, 0, bufferSizeMax-CROSS_FADE_AMT);
+			cubeGeneration[recordBuffer]++;
+
+			//Cross fade out the tail end of the current buffer, and fade anything after the end so the overflow mode doesn't have clicks
+			cubeFadeOutAt[recordBuffer] = loopSize[recordBuffer];
+
+			//If intial recording, copy it over to the buffer half the cubes down
+			int half = cubeCount / 2;
+			if(recordBuffer < half && loopSize[recordBuffer + half] == 0){
+				int bi = recordBuffer + half;
+				int ls = loopSize[recordBuffer];
+				loopSize[bi] = ls;
+				cubeFadeIn[bi] = cubeFadeIn[recordBuffer];
+				cubeFadeOutAt[bi] = cubeFadeOutAt[recordBuffer];
+				cubeGeneration[bi]++;
+				//Shares pages, they are only copied when one of the cubes is recorded over
+				buffers[bi].shareFrom(buffers[recordBuffer], ls);
+				for(int gi = 0; gi < voiceGroups; gi++){
+					voiceBuffers[gi][bi].shareFrom(voiceBuffers[gi][recordBuffer], ls);
 				}
-			}
-
-			//Also fade anything after the current end so the overflow mode doesn't have clicks
-			for(int ci = 0; ci < CROSS_FADE_AMT; ci++){
-				int i = loopSize[recordBuffer] + ci;
-				if(i >= 0){
-					float scalar = (float)ci/CROSS_FADE_AMT;
-					buffers[recordBuffer][i][0] *= scalar;
-					buffers[recordBuffer][i][1] *= scalar;
+				if(CubeOverview* overview = overviewOf(bi)){
+					overviewOf(recordBuffer)->finishBin();
+					overview->copyFrom(overviews[recordBuffer]);
 				}
 			}
+			if(CubeOverview* overview = overviewOf(recordBuffer)) overview->finishBin();
 
-			//If intial recording, copy it over to the buffer 3 down
-			if(recordBuffer < 3 && loopSize[recordBuffer + 3] == 0){
-				int bi = recordBuffer + 3;
-				int ls = loopSize[recordBuffer];
-				loopSize[bi] = ls;
-				for(int i = 0; i < ls; i++){
-					buffers[bi][i][0] = buffers[recordBuffer][i][0];
-					buffers[bi][i][1] = buffers[recordBuffer][i][1];
-				}
+			//Audio left past the end of a shorter loop is never saved, give its memory back
+			int extent = cubeExtent(recordBuffer);
+			buffers[recordBuffer].trim(extent);
+			for(int gi = 0; gi < voiceGroups; gi++){
+				voiceBuffers[gi][recordBuffer].trim(extent);
 			}
 		}
 
 		int freeBuffer = record_nextFreeBuffer();
+		//Out of cube memory, stop recording until a later jump finds room (playback jumps keep retrying)
+		recordingBlocked = freeBuffer != -1 && !recordingFits(freeBuffer);
+		if(recordingBlocked) freeBuffer = -1;
 		recordBuffer = freeBuffer;
 		recordIndex = recordCrossFadePreBufferIndex - floor(recordCrossFadePreBufferIndex) + CROSS_FADE_AMT - 1;
 
-		//Copy the PRE recording buffer into start of new buffer
+		//The PRE recording buffer goes into the start of the new buffer, copied over the next samples by copyPreRoll
 		if(recordBuffer != -1){
-			for(int ci = 0; ci < CROSS_FADE_AMT; ci++){
-				int i = 1 + ci + floor(recordCrossFadePreBufferIndex);
-				if(i >= CROSS_FADE_AMT) i -= CROSS_FADE_AMT;
-				float scalar = (float)ci / CROSS_FADE_AMT;
-				buffers[recordBuffer][ci][0] = recordCrossFadePreBuffer[i][0] * scalar;
-				buffers[recordBuffer][ci][1] = recordCrossFadePreBuffer[i][1] * scalar;
+			cubeGeneration[recordBuffer]++;
+			cubeFadeIn[recordBuffer] = true;
+			cubeFadeOutAt[recordBuffer] = -1;
+			preRollOldest = 1 + floor(recordCrossFadePreBufferIndex);
+			if(preRollOldest >= CROSS_FADE_AMT) preRollOldest -= CROSS_FADE_AMT;
+			preRollCopied = 0;
+			if(CubeOverview* overview = overviewOf(recordBuffer)){
+				//Starts the pre-roll's bins over, leaving recording in the bin the record head starts in
+				overview->startRecording();
+				overview->record(0, CROSS_FADE_AMT, 0.f, 0.f);
 			}
 		}
 
@@ -809,41 +2121,58 @@ struct IceTray : Module {
 		updateRecordAndPlaybackLights();
 	}
 
-	//setCurCrossFadeTo0 is true if we've already handled the current frames output and we should set playbackCrossFadeBuffer[0] to 0
+	//Adds the output of every fading playhead reading from cubes, see advanceFadeVoices
+	template <typename T>
+	void mixFadeVoices(T & out0, T & out1, const Cube<MAX_CHANNELS, T>* cubes){
+		for(int vi = 0; vi < FADE_VOICES; vi++){
+			FadeVoice& voice = fadeVoices[vi];
+			if(voice.position >= CROSS_FADE_AMT) continue;
+			if(voice.runover || voice.index < voice.loopSize){
+				T o0, o1;
+				getPlaybackOuput(o0, o1, cubes, voice.buffer, voice.loopSize, voice.fadeInStart, voice.index);
+				float scalar = 1.f-((float)voice.position/CROSS_FADE_AMT);
+				out0 += o0 * scalar;
+				out1 += o1 * scalar;
+			}
+		}
+	}
+
+	//Moves every fading playhead on a frame, once per sample however many voice groups were mixed
+	void advanceFadeVoices(){
+		for(int vi = 0; vi < FADE_VOICES; vi++){
+			FadeVoice& voice = fadeVoices[vi];
+			if(voice.position >= CROSS_FADE_AMT) continue;
+			voice.index++;
+			voice.position++;
+		}
+	}
+
+	//Hands the current playhead to a fade voice, which reads the rest of the cube as it fades out
+	//setCurCrossFadeTo0 is true if the current frame was already output, the voice then starts on the next frame
+	void startFadeVoice(bool setCurCrossFadeTo0){
+		FadeVoice* voice = &fadeVoices[0];
+		for(int vi = 1; vi < FADE_VOICES; vi++){
+			if(fadeVoices[vi].position > voice->position) voice = &fadeVoices[vi];
+		}
+		voice->buffer = playbackBuffer;
+		voice->loopSize = std::min(loopSize[playbackBuffer], bufferSizeMax);
+		voice->fadeInStart = fadeInStart;
+		voice->runover = params[PLAYBACK_MODE_PARAM].getValue() == 0;
+		voice->index = playbackIndex;
+		voice->position = 0;
+		if(setCurCrossFadeTo0){
+			voice->index++;
+			voice->position++;
+		}
+	}
+
+	//setCurCrossFadeTo0 is true if we've already handled the current frames output, see startFadeVoice
 	void playback_jumpToNextTrack(bool forceResetPBI, bool setCurCrossFadeTo0) {
 
 		bool runover = params[PLAYBACK_MODE_PARAM].getValue() == 0;
 
 		if(playbackBuffer != -1){
-			//Queue of the remainder of this buffer into the cross fade
-			int ls = std::min(loopSize[playbackBuffer], BUFFER_SIZE_MAX);
-			for(int ci = 0; ci < CROSS_FADE_AMT; ci++){
-				int i = ci + playbackIndex;
-				float cxFade0 = 0;
-				float cxFade1 = 0;
-				if(ci > 0 || !setCurCrossFadeTo0){
-					if(runover){
-						//while(i > ls) i -= ls;
-						getPlaybackOuput(cxFade0,cxFade1,i);
-					}else{
-						if(i < ls){
-							getPlaybackOuput(cxFade0,cxFade1,i);
-						}
-					}
-					float scalar = 1.f-((float)ci/CROSS_FADE_AMT);
-					cxFade0 *= scalar;
-					cxFade1 *= scalar;
-					//Also carry forward any previous crossFade
-					int previousCrossFadeIndex = ci + playbackCrossFadeBufferIndex;
-					if(previousCrossFadeIndex < CROSS_FADE_AMT){
-						cxFade0 += playbackCrossFadeBuffer[previousCrossFadeIndex][0];
-						cxFade1 += playbackCrossFadeBuffer[previousCrossFadeIndex][1];
-					}
-				}
-				playbackCrossFadeBuffer[ci][0] = cxFade0;
-				playbackCrossFadeBuffer[ci][1] = cxFade1;
-			}
-			playbackCrossFadeBufferIndex = 0;
+			startFadeVoice(setCurCrossFadeTo0);
 		}
 
 		if(forceResetPBI || !runover){
@@ -873,10 +2202,10 @@ struct IceTray : Module {
 	}
 
 	int record_nextFreeBuffer(){
-		for(int i = 1; i <= BUFFER_COUNT; i++){
+		for(int i = 1; i <= cubeCount; i++){
 			int test = recordBuffer + i;
-			while(test < 0) test += BUFFER_COUNT;
-			while(test >= BUFFER_COUNT) test -= BUFFER_COUNT;
+			while(test < 0) test += cubeCount;
+			while(test >= cubeCount) test -= cubeCount;
 			if(isBufferFree(test,true)){
 				return test;
 			}
@@ -886,36 +2215,33 @@ struct IceTray : Module {
 
 	int playback_nextFreeBuffer(){
 		float pattern = params[PATERN_PARAM].getValue() * inputs[PATERN_CV_INPUT].getNormalVoltage(10.f)/10.f;
+		pattern = clamp(pattern, -1.f, 1.f);
 
 		if(pattern < 0){
-			int patternIndex = std::round(-pattern*24);
-			int maxJump = READ_PATTERN_NEG[patternIndex][nextReadPatternIndex];
+			int patternIndex = std::round(-pattern*(negativeReadPatternRows(cubeCount) - 1));
+			int maxJump = negativeReadPatternJump(cubeCount, patternIndex, nextReadPatternIndex);
 			int firstJump = floor(rack::random::uniform() * rack::random::uniform() * maxJump + 1);
 			for(int i = firstJump; i >= 1; i--){
 				int test = playbackBuffer + i;
-				while(test < 0) test += BUFFER_COUNT;
-				while(test >= BUFFER_COUNT) test -= BUFFER_COUNT;
+				while(test < 0) test += cubeCount;
+				while(test >= cubeCount) test -= cubeCount;
 				if(isBufferFree(test,false)){
 					return test;
 				}
 			}
-			for(int i = firstJump+1; i < BUFFER_COUNT; i++){
+			for(int i = firstJump+1; i < cubeCount; i++){
 				int test = playbackBuffer + i;
-				while(test < 0) test += BUFFER_COUNT;
-				while(test >= BUFFER_COUNT) test -= BUFFER_COUNT;
+				while(test < 0) test += cubeCount;
+				while(test >= cubeCount) test -= cubeCount;
 				if(isBufferFree(test,false)){
 					return test;
 				}
 			}
 		}else{
-			int patternIndex = std::round(pattern*119);
-			for(int i = 1; i < BUFFER_COUNT; i++){
+			for(int i = 1; i < cubeCount; i++){
 				nextReadPatternIndex++;
-				if(nextReadPatternIndex >= BUFFER_COUNT) nextReadPatternIndex = 0;
-				int test = READ_PATTERN_POS[patternIndex][nextReadPatternIndex];
-
-				while(test < 0) test += BUFFER_COUNT;
-				while(test >= BUFFER_COUNT) test -= BUFFER_COUNT;
+				if(nextReadPatternIndex >= cubeCount) nextReadPatternIndex = 0;
+				int test = readPatterns.cube(cubeCount, pattern, nextReadPatternIndex);
 				if(isBufferFree(test,false)){
 					return test;
 				}
@@ -936,14 +2262,14 @@ struct IceTray : Module {
 	void updateBufferLocks(){
 		int recordCnt = 0;
 		int frozenCnt = 0;
-		for(int bi = 0; bi < BUFFER_COUNT; bi++){
+		for(int bi = 0; bi < cubeCount; bi++){
 			if(bufferLockLevel[bi] == NONE) recordCnt++;
 			if(bufferLockLevel[bi] == ALL) frozenCnt++;
 		}
 		float lockChangeChance = 1.f - (params[FROST_PARAM].getValue() + params[FROST_CK_PARAM].getValue() * inputs[FROST_CV_INPUT].getVoltage()/10.f);
 
 		if(rack::random::uniform() < lockChangeChance){
-			int index = floor(rack::random::uniform() * BUFFER_COUNT);
+			int index = floor(rack::random::uniform() * cubeCount);
 			if(index == recordBuffer) return;
 			if(index == playbackBuffer) return;
 			int level = bufferLockLevel[index];
@@ -963,6 +2289,78 @@ struct IceTray : Module {
 };
 
 
+//Asks for a WAV file to export to or import from, returns an empty string if the dialog was cancelled
+static std::string chooseWavFile(osdialog_file_action action, const std::string& filename){
+	osdialog_filters* filters = osdialog_filters_parse("WAV:wav");
+	char* chosen = osdialog_file(action, NULL, filename.c_str(), filters);
+	osdialog_filters_free(filters);
+	if(chosen == NULL) return "";
+	std::string path = chosen;
+	std::free(chosen);
+	if(action == OSDIALOG_SAVE && system::getExtension(path) != ".wav") path += ".wav";
+	return path;
+}
+
+static const NVGcolor WAVEFORM_COLOR = nvgRGBA(0x7f, 0xcf, 0xff, 0xc0);
+static const NVGcolor PLAYHEAD_COLOR = nvgRGBA(0xff, 0xff, 0xff, 0xe0);
+
+//Voltage drawn at the top and bottom of a waveform display
+#define WAVEFORM_VOLTAGE 10.f
+
+//Draws the waveform of one cube from its overview, with the playhead while it is playing
+//Only a few overview bins are read per column, so it is cheap to redraw every frame
+struct CubeWaveformDisplay : TransparentWidget {
+	IceTray* module = NULL;
+	int buffer = 0;
+
+	void drawLayer(const DrawArgs& args, int layer) override {
+		//Layer 1 is drawn at full brightness, like the lights
+		if(layer == 1 && module) drawWaveform(args);
+		TransparentWidget::drawLayer(args, layer);
+	}
+
+	void drawWaveform(const DrawArgs& args){
+		int frames = module->loopSize[buffer];
+		if(buffer == module->recordBuffer) frames = std::max(frames, (int)module->recordIndex);
+		if(frames <= 0) return;
+
+		const CubeOverview& overview = module->overviews[buffer];
+		int columns = std::max(1, (int)box.size.x);
+		float middle = box.size.y / 2.f;
+		nvgBeginPath(args.vg);
+		for(int x = 0; x < columns; x++){
+			float peakLow, peakHigh;
+			overview.peaks((int64_t)x * frames / columns, (int64_t)(x + 1) * frames / columns, peakLow, peakHigh);
+			//At least a pixel tall so silence still shows where the cube is
+			float top = middle - clamp(peakHigh / WAVEFORM_VOLTAGE, -1.f, 1.f) * middle - 0.5f;
+			float bottom = middle - clamp(peakLow / WAVEFORM_VOLTAGE, -1.f, 1.f) * middle + 0.5f;
+			nvgMoveTo(args.vg, x + 0.5f, top);
+			nvgLineTo(args.vg, x + 0.5f, bottom);
+		}
+		nvgStrokeWidth(args.vg, 1.f);
+		nvgStrokeColor(args.vg, WAVEFORM_COLOR);
+		nvgStroke(args.vg);
+
+		if(buffer == module->playbackBuffer){
+			float x = clamp((float)module->playbackIndex / frames, 0.f, 1.f) * box.size.x;
+			nvgBeginPath(args.vg);
+			nvgMoveTo(args.vg, x, 0.f);
+			nvgLineTo(args.vg, x, box.size.y);
+			nvgStrokeColor(args.vg, PLAYHEAD_COLOR);
+			nvgStroke(args.vg);
+		}
+	}
+};
+
+//Adds a waveform display for cube bi centered at pos (in mm)
+static void addCubeWaveform(ModuleWidget* widget, IceTray* module, int bi, Vec pos){
+	CubeWaveformDisplay* display = createWidget<CubeWaveformDisplay>(mm2px(pos.minus(Vec(8.f, 2.5f))));
+	display->box.size = mm2px(Vec(16.f, 5.f));
+	display->module = module;
+	display->buffer = bi;
+	widget->addChild(display);
+}
+
 struct IceTrayWidget : ModuleWidget {
 	IceTrayWidget(IceTray* module) {
 		setModule(module);
@@ -1024,6 +2422,14 @@ struct IceTrayWidget : ModuleWidget {
 		addChild(createLightCentered<SmallLight<RedGreenBlueLight>>(mm2px(Vec(71.461, 47.288)), module, IceTray::RP_LIGHT + 3 * 3));
 		addChild(createLightCentered<SmallLight<RedGreenBlueLight>>(mm2px(Vec(71.394, 72.144)), module, IceTray::RP_LIGHT + 4 * 3));
 		addChild(createLightCentered<SmallLight<RedGreenBlueLight>>(mm2px(Vec(71.461, 97.0)), module, IceTray::RP_LIGHT + 5 * 3));
+
+		//Below each cube button, above the next row
+		addCubeWaveform(this, module, 0, Vec(51.936, 52.374));
+		addCubeWaveform(this, module, 1, Vec(51.936, 77.321));
+		addCubeWaveform(this, module, 2, Vec(51.936, 102.267));
+		addCubeWaveform(this, module, 3, Vec(74.756, 52.422));
+		addCubeWaveform(this, module, 4, Vec(74.756, 77.321));
+		addCubeWaveform(this, module, 5, Vec(74.851, 102.22));
 	}
 
 	void appendContextMenu(Menu* menu) override {
@@ -1035,7 +2441,8 @@ struct IceTrayWidget : ModuleWidget {
 		struct ClearCubes : MenuItem {
 			IceTray* module;
 			void onAction(const event::Action& e) override {
-				module->clearCubes();
+				module->clearCubesRequested = true;
+				module->waitForCubeIO(true);
 			}
 		};
 
@@ -1045,27 +2452,142 @@ struct IceTrayWidget : ModuleWidget {
 			menu->addChild(menuItem);
 		}
 
+		menu->addChild(createSubmenuItem("Export Cube", "",
+			[=](Menu* menu) {
+				if(module->polyphonic) menu->addChild(createMenuLabel("Only summed stereo cubes can be exported."));
+				for(int bi = 0; bi < module->cubeCount; bi++){
+					std::string name = "Cube " + std::to_string(bi + 1);
+					bool empty = module->loopSize[bi] == 0;
+					menu->addChild(createMenuItem(name, empty ? "Empty" : "", [module, bi, name]() {
+						std::string path = chooseWavFile(OSDIALOG_SAVE, name + ".wav");
+						if(!path.empty()) module->exportCubeWav(bi, path);
+					}, empty || module->polyphonic));
+				}
+			}
+		));
+
+		menu->addChild(createSubmenuItem("Import Cube", "",
+			[=](Menu* menu) {
+				menu->addChild(createMenuLabel("Imported cubes are locked against recording."));
+				if(module->polyphonic) menu->addChild(createMenuLabel("Only summed stereo cubes can be imported."));
+				for(int bi = 0; bi < module->cubeCount; bi++){
+					menu->addChild(createMenuItem("Cube " + std::to_string(bi + 1), "", [module, bi]() {
+						std::string path = chooseWavFile(OSDIALOG_OPEN, "");
+						if(!path.empty()) module->importCubeWav(bi, path);
+					}, module->polyphonic));
+				}
+			}
+		));
+
+		menu->addChild(createSubmenuItem("Cube Count", std::to_string(module->cubeCount),
+			[=](Menu* menu) {
+				menu->addChild(createMenuLabel(string::f("Cubes past the %ith have no panel controls.", PANEL_CUBE_COUNT)));
+				menu->addChild(createMenuLabel("Removing cubes clears them."));
+				for(int count = CUBE_COUNT_MIN; count <= CUBE_COUNT_MAX; count++){
+					menu->addChild(createMenuItem(std::to_string(count), CHECKMARK(module->cubeCount == count), [module, count]() {
+						//Only starts the ranking thread under its own lock, process() never touches the thread
+						module->readPatterns.reserve(count);
+						module->waitForCubeIO(false);
+						module->cubeCountRequested = count;
+					}));
+				}
+			}
+		));
+
+		menu->addChild(createSubmenuItem("Cube Storage", module->mapCubes ? "Memory Mapped" : "In Memory",
+			[=](Menu* menu) {
+				menu->addChild(createMenuLabel("Takes effect the next time the patch is loaded."));
+				menu->addChild(createMenuItem("In Memory", CHECKMARK(module->mapCubes == false), [module]() { 
+					module->mapCubes = false;
+				}));
+				menu->addChild(createMenuItem("Memory Mapped (Instant Load)", CHECKMARK(module->mapCubes == true), [module]() { 
+					module->mapCubes = true;
+				}));
+			}
+		));
+
+		static const std::string encodingNames [CUBE_ENCODINGS] = {"32-bit Float", "24-bit", "16-bit (Half Memory)"};
+		static const int memoryLimits [] = {0, 256, 512, 1024, 2048, 4096, 8192};
+		int64_t memoryLimit = cubeBudget().limit >> 20;
+		menu->addChild(createSubmenuItem("Cube Memory Limit", memoryLimit == 0 ? "Unlimited" : string::f("%lld MB", (long long)memoryLimit),
+			[=](Menu* menu) {
+				menu->addChild(createMenuLabel(string::f("%lld MB in use by all Ice Trays, %lld MB held ready", (long long)(cubeBudget().used >> 20), (long long)(cubeBudget().pooled >> 20))));
+				menu->addChild(createMenuLabel("Recording stops and waits when the limit is reached."));
+				if(module->recordingBlocked) menu->addChild(createMenuLabel("This Ice Tray is waiting for memory."));
+				for(int limit : memoryLimits){
+					std::string name = limit == 0 ? "Unlimited" : string::f("%i MB", limit);
+					menu->addChild(createMenuItem(name, CHECKMARK(memoryLimit == limit), [limit]() {
+						cubeBudget().limit = (int64_t)limit << 20;
+						saveCubeBudgetSettings();
+					}));
+				}
+			}
+		));
+
+		menu->addChild(createSubmenuItem("Cube Precision", encodingNames[module->cubeEncoding],
+			[=](Menu* menu) {
+				menu->addChild(createMenuLabel("Existing audio is converted in the background."));
+				for(int ei = 0; ei < CUBE_ENCODINGS; ei++){
+					menu->addChild(createMenuItem(encodingNames[ei], CHECKMARK(module->cubeEncoding == ei), [module, ei]() { 
+						module->cubeEncoding = ei;
+						module->reserveCubePages();
+					}));
+				}
+			}
+		));
+
+		menu->addChild(createSubmenuItem("Cube File Compression", module->cubeCompression == CUBE_COMPRESSION_LOSSY ? "Lossy" : "Lossless",
+			[=](Menu* menu) {
+				menu->addChild(createMenuLabel("Used when the patch is saved, memory mapped cubes are never compressed."));
+				menu->addChild(createMenuItem("Lossless", CHECKMARK(module->cubeCompression == CUBE_COMPRESSION_LOSSLESS), [module]() { 
+					module->cubeCompression = CUBE_COMPRESSION_LOSSLESS;
+				}));
+				menu->addChild(createMenuItem("Lossy (16-bit)", CHECKMARK(module->cubeCompression == CUBE_COMPRESSION_LOSSY), [module]() { 
+					module->cubeCompression = CUBE_COMPRESSION_LOSSY;
+				}));
+			}
+		));
+
+		menu->addChild(createSubmenuItem("Polyphony", module->polyphonic ? "Polyphonic" : "Summed",
+			[=](Menu* menu) {
+				menu->addChild(createMenuItem("Summed Stereo", CHECKMARK(module->polyphonic == false), [module]() { 
+					module->polyphonic = false;
+				}));
+				menu->addChild(createMenuItem("Polyphonic (Up To 16 Voices)", CHECKMARK(module->polyphonic == true), [module]() { 
+					module->polyphonic = true;
+					module->reserveCubePages();
+				}));
+			}
+		));
+
 		menu->addChild(new MenuEntry);
 		menu->addChild(createMenuLabel("Pitch Correction"));
+		if(module->polyphonic) menu->addChild(createMenuLabel("Polyphonic voices always use Time Domain."));
 
 		struct PitchCorrectionMenuItem : MenuItem {
 			IceTray* module;
-			bool value;
+			int value;
 			void onAction(const event::Action& e) override {
-				module->pitchCorrectionOn = value;
+				module->pitchCorrection = value;
 			}
 		};
 
-		PitchCorrectionMenuItem* mi = createMenuItem<PitchCorrectionMenuItem>("On");
-		mi->rightText = CHECKMARK(module->pitchCorrectionOn);
+		PitchCorrectionMenuItem* mi = createMenuItem<PitchCorrectionMenuItem>("Spectral (Summed Stereo Only)");
+		mi->rightText = CHECKMARK(module->pitchCorrection == IceTray::PITCH_CORRECTION_SPECTRAL);
+		mi->module = module;
+		mi->value = IceTray::PITCH_CORRECTION_SPECTRAL;
+		menu->addChild(mi);
+
+		mi = createMenuItem<PitchCorrectionMenuItem>("Time Domain (Low Latency)");
+		mi->rightText = CHECKMARK(module->pitchCorrection == IceTray::PITCH_CORRECTION_TIME_DOMAIN);
 		mi->module = module;
-		mi->value = true;
+		mi->value = IceTray::PITCH_CORRECTION_TIME_DOMAIN;
 		menu->addChild(mi);
 
 		mi = createMenuItem<PitchCorrectionMenuItem>("Off (Saves CPU)");
-		mi->rightText = CHECKMARK(!module->pitchCorrectionOn);
+		mi->rightText = CHECKMARK(module->pitchCorrection == IceTray::PITCH_CORRECTION_OFF);
 		mi->module = module;
-		mi->value = false;
+		mi->value = IceTray::PITCH_CORRECTION_OFF;
 		menu->addChild(mi);
 	}
 };
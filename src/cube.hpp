@@ -0,0 +1,583 @@
+#pragma once
+
+#include <rack.hpp>
+#include "cubeBudget.hpp"
+#include "cubePagePool.hpp"
+
+#define CUBE_PAGE_SHIFT 12
+#define CUBE_PAGE_FRAMES (1 << CUBE_PAGE_SHIFT)
+#define CUBE_PAGE_MASK (CUBE_PAGE_FRAMES - 1)
+
+///Voltage the integer encodings store at full scale, louder samples are clipped.
+#define CUBE_FULL_SCALE 16.f
+
+/**
+ * How a page stores its samples.
+ *
+ * The integer encodings are scaled so CUBE_FULL_SCALE volts is full scale, which keeps a ±10 V signal well above their noise floor.
+ */
+enum CubeEncoding {
+	CUBE_FLOAT32,
+	CUBE_INT24,
+	CUBE_INT16,
+	CUBE_ENCODINGS
+};
+
+inline int cubeSampleBytes(int encoding){
+	switch(encoding){
+		case CUBE_INT24: return 3;
+		case CUBE_INT16: return 2;
+		default: return 4;
+	}
+}
+
+inline float cubeEncodingMax(int encoding){
+	return encoding == CUBE_INT24 ? 8388607.f : 32767.f;
+}
+
+///Converts count float values to encoding, four at a time.
+inline void encodeCubeSamples(const float* source, int encoding, char* destination, int count){
+	if(encoding == CUBE_FLOAT32){
+		memcpy(destination, source, count * sizeof(float));
+		return;
+	}
+	float max = cubeEncodingMax(encoding);
+	float scale = max / CUBE_FULL_SCALE;
+	int i = 0;
+	if(encoding == CUBE_INT16){
+		int16_t* out = (int16_t*)destination;
+		for(; i + 4 <= count; i += 4){
+			rack::simd::float_4 x = rack::simd::clamp(rack::simd::float_4::load(source + i) * scale, -max, max);
+			__m128i words = _mm_cvtps_epi32(x.v);
+			_mm_storel_epi64((__m128i*)(out + i), _mm_packs_epi32(words, words));
+		}
+		for(; i < count; i++){
+			out[i] = (int16_t)std::lrint(std::max(-max, std::min(source[i] * scale, max)));
+		}
+		return;
+	}
+	uint8_t* out = (uint8_t*)destination;
+	int32_t words [4];
+	for(; i < count; i += 4){
+		int n = std::min(4, count - i);
+		rack::simd::float_4 x = 0.f;
+		for(int li = 0; li < n; li++) x.s[li] = source[i + li];
+		x = rack::simd::clamp(x * scale, -max, max);
+		_mm_storeu_si128((__m128i*)words, _mm_cvtps_epi32(x.v));
+		for(int li = 0; li < n; li++){
+			uint8_t* sample = out + (i + li) * 3;
+			sample[0] = words[li];
+			sample[1] = words[li] >> 8;
+			sample[2] = words[li] >> 16;
+		}
+	}
+}
+
+///Converts count values stored with encoding back to float, four at a time.
+inline void decodeCubeSamples(const char* source, int encoding, float* destination, int count){
+	if(encoding == CUBE_FLOAT32){
+		memcpy(destination, source, count * sizeof(float));
+		return;
+	}
+	float scale = CUBE_FULL_SCALE / cubeEncodingMax(encoding);
+	int i = 0;
+	if(encoding == CUBE_INT16){
+		const int16_t* in = (const int16_t*)source;
+		for(; i + 4 <= count; i += 4){
+			__m128i words = _mm_loadl_epi64((const __m128i*)(in + i));
+			//Sign extends each 16 bit word to 32 bits
+			words = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+			(rack::simd::float_4(_mm_cvtepi32_ps(words)) * scale).store(destination + i);
+		}
+		for(; i < count; i++){
+			destination[i] = in[i] * scale;
+		}
+		return;
+	}
+	const uint8_t* in = (const uint8_t*)source;
+	int32_t words [4] = {};
+	for(; i < count; i += 4){
+		int n = std::min(4, count - i);
+		for(int li = 0; li < n; li++){
+			const uint8_t* sample = in + (i + li) * 3;
+			uint32_t word = sample[0] | (sample[1] << 8) | (sample[2] << 16);
+			words[li] = (int32_t)(word << 8) >> 8;
+		}
+		rack::simd::float_4 x = rack::simd::float_4(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)words))) * scale;
+		for(int li = 0; li < n; li++) destination[i + li] = x[li];
+	}
+}
+
+///Converts count values between encodings, through float one page plane at a time.
+inline void convertCubeSamples(const char* source, int sourceEncoding, char* destination, int encoding, int count){
+	if(sourceEncoding == encoding){
+		memcpy(destination, source, (size_t)count * cubeSampleBytes(encoding));
+		return;
+	}
+	float values [CUBE_PAGE_FRAMES];
+	for(int i = 0; i < count; i += CUBE_PAGE_FRAMES){
+		int n = std::min(CUBE_PAGE_FRAMES, count - i);
+		decodeCubeSamples(source + (size_t)i * cubeSampleBytes(sourceEncoding), sourceEncoding, values, n);
+		encodeCubeSamples(values, encoding, destination + (size_t)i * cubeSampleBytes(encoding), n);
+	}
+}
+
+/**
+ * A fixed size block of CUBE_PAGE_FRAMES frames of cube audio.
+ *
+ * Samples are planar, each channel's CUBE_PAGE_FRAMES samples follow the previous channel's, so kernels can work on runs of frames of one channel.
+ * A sample is a float, or a simd::float_4 holding the same channel of four polyphonic voices, stored with the page's encoding.
+ *
+ * Pages are reference counted so cubes (and save snapshots) can share them. A shared page is copied the next time it is written.
+ *
+ * Heap pages live in a block from cubePagePool, the samples start CUBE_PAGE_ALIGN bytes after the page itself.
+ */
+template <int CHANNELS, typename T = float>
+struct CubePage {
+	static const int SAMPLES = CHANNELS * CUBE_PAGE_FRAMES;
+	///Float values in each sample.
+	static const int LANES = sizeof(T) / sizeof(float);
+	static const int VALUES = SAMPLES * LANES;
+
+	std::atomic<int> refs {1};
+
+	///Samples live in a mapped cube file. Mapped pages belong to a single cube and are never shared.
+	bool mapped = false;
+
+	int encoding;
+
+	char* data;
+
+	static size_t bytes(int encoding){
+		return (size_t)VALUES * cubeSampleBytes(encoding);
+	}
+
+	///Size of the pool block holding a heap page.
+	static size_t blockBytes(int encoding){
+		return CUBE_PAGE_ALIGN + bytes(encoding);
+	}
+
+	/**
+	 * Creates a heap page charged to cubeBudget, silent if zero is set, otherwise holding whatever the block last held.
+	 *
+	 * Returns NULL when the pool has no block ready on the audio thread or memory runs out, the caller drops the write.
+	 * A capped page is also refused when it would take cubeBudget past its limit, see CubeBudget::tryCharge.
+	 */
+	static CubePage* create(int encoding, bool zero, bool capped){
+		if(capped){
+			if(!cubeBudget().tryCharge(bytes(encoding))) return NULL;
+		}else{
+			cubeBudget().charge(bytes(encoding));
+		}
+		void* block = cubePagePool().acquire(blockBytes(encoding), zero);
+		if(block == NULL){
+			cubeBudget().refund(bytes(encoding));
+			return NULL;
+		}
+		return new(block) CubePage((char*)block + CUBE_PAGE_ALIGN, encoding, false);
+	}
+
+	///Creates a page over samples owned by a mapped file.
+	static CubePage* createMapped(char* mappedData, int encoding){
+		return new CubePage(mappedData, encoding, true);
+	}
+
+	CubePage(char* data, int encoding, bool mapped) : mapped(mapped), encoding(encoding), data(data) {}
+
+	void retain(){
+		refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void release(){
+		if(refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+		if(mapped){
+			delete this;
+			return;
+		}
+		int e = encoding;
+		cubeBudget().refund(bytes(e));
+		this->~CubePage();
+		cubePagePool().release(this, blockBytes(e));
+	}
+
+	///Address of sample i, counting across all channels of the page.
+	char* at(int i) const {
+		return data + (size_t)i * LANES * cubeSampleBytes(encoding);
+	}
+};
+
+template <int CHANNELS, typename T>
+struct CubeCopy;
+
+/**
+ * Audio for one cube, stored as a table of copy-on-write planar pages.
+ *
+ * Pages that were never written are NULL and read as silence, so a new or cleared cube costs no memory.
+ *
+ * Each page keeps the encoding it was written with. New pages use the cube's encoding, older pages are converted the next time they are written or by convertPage.
+ *
+ * Copying a Cube shares its pages, which makes copies O(pages) instead of O(frames).
+ * Writes that need a new page take it from cubePagePool. On the audio thread they can find none ready, the write is then dropped and reported to the caller.
+ * Sample and frame writes are capped by cubeBudget's limit unless told otherwise, whole page writes and copies of audio the module already held are not.
+ * Only the thread that writes the cube may copy it or change which pages it uses, other threads may only hold and release copies.
+ * Mapped pages can't be shared, a CubeCopy attached to a mapped cube copies them out a page at a time instead.
+ */
+template <int CHANNELS, typename T = float>
+struct Cube {
+	typedef T Sample;
+	typedef CubePage<CHANNELS, T> Page;
+
+	std::vector<Page*> pages;
+
+	///Number of frames in the cube.
+	int size = 0;
+
+	///Pages point into a mapped cube file, see map.
+	bool mapped = false;
+
+	///Encoding of newly written heap pages. Mapped pages keep the encoding of their file.
+	int encoding = CUBE_FLOAT32;
+
+	///Copy being taken of this mapped cube, pages are copied to it before they are changed. Never copied with the cube.
+	CubeCopy<CHANNELS, T>* copy = NULL;
+
+	Cube(){}
+
+	Cube(const Cube& other){
+		*this = other;
+	}
+
+	~Cube(){
+		releasePages();
+	}
+
+	///Shares every page of other. Mapped pages can't be shared, so a mapped cube is copied page by page instead.
+	Cube& operator=(const Cube& other){
+		if(this == &other) return *this;
+		releasePages();
+		mapped = false;
+		encoding = other.encoding;
+		if(other.mapped){
+			resize(other.size);
+			for(size_t pi = 0; pi < pages.size(); pi++){
+				copyPage(pi, other.pages[pi]);
+			}
+			return *this;
+		}
+		pages = other.pages;
+		size = other.size;
+		for(size_t pi = 0; pi < pages.size(); pi++){
+			if(pages[pi] != NULL) pages[pi]->retain();
+		}
+		return *this;
+	}
+
+	static int pageCount(int frames){
+		return (frames + CUBE_PAGE_MASK) >> CUBE_PAGE_SHIFT;
+	}
+
+	///Grows or shrinks the cube, audio that still fits is kept.
+	void resize(int frames){
+		int count = pageCount(frames);
+		for(size_t pi = count; pi < pages.size(); pi++){
+			if(pages[pi] != NULL) pages[pi]->release();
+		}
+		pages.resize(count, NULL);
+		size = frames;
+	}
+
+	/**
+	 * Uses whole pages of a mapped file as the cube's storage, replacing any pages it had.
+	 *
+	 * data must hold pageCount(size) planar pages of Page::bytes(encoding), and the mapping must outlive the cube or be followed by unmap.
+	 */
+	void map(char* data, int size, int encoding){
+		releasePages();
+		int count = pageCount(size);
+		pages.resize(count);
+		for(int pi = 0; pi < count; pi++){
+			pages[pi] = Page::createMapped(data + pi * Page::bytes(encoding), encoding);
+		}
+		this->size = size;
+		mapped = true;
+	}
+
+	///Drops the pages of a mapped cube, leaving it silent. A copy being taken is finished first.
+	void unmap(){
+		if(!mapped) return;
+		if(copy != NULL){
+			while(!copy->step(*this)){}
+			copy = NULL;
+		}
+		releasePages();
+		pages.resize(pageCount(size), NULL);
+		mapped = false;
+	}
+
+	T read(int channel, int frame) const {
+		const Page* page = pages[frame >> CUBE_PAGE_SHIFT];
+		if(page == NULL) return T(0.f);
+		int i = channel * CUBE_PAGE_FRAMES + (frame & CUBE_PAGE_MASK);
+		if(page->encoding == CUBE_FLOAT32) return ((const T*)page->data)[i];
+		T sample;
+		decodeCubeSamples(page->at(i), page->encoding, (float*)&sample, Page::LANES);
+		return sample;
+	}
+
+	///True if frame is in a page that was never written, so it and the rest of its page are silent.
+	bool isSilent(int frame) const {
+		return pages[frame >> CUBE_PAGE_SHIFT] == NULL;
+	}
+
+	/**
+	 * Returns a page that can be written, first copying it if it is shared or in another encoding, or creating it if it is silent.
+	 *
+	 * Returns NULL if no page could be created, see CubePage::create. The page is then left as it was.
+	 */
+	Page* writePage(int page, bool capped){
+		copyOut(page);
+		Page*& p = pages[page];
+		if(p == NULL || (!p->mapped && (p->encoding != encoding || p->refs.load(std::memory_order_acquire) > 1))){
+			if(!makeWritable(p, capped)) return NULL;
+		}
+		return p;
+	}
+
+	///Number of frames from frame to the end of its page.
+	static int spanAt(int frame){
+		return CUBE_PAGE_FRAMES - (frame & CUBE_PAGE_MASK);
+	}
+
+	///Copies count samples of one channel from source into the cube starting at frame.
+	///Returns false if a page couldn't be created, the samples meant for it are dropped and the rest are still written.
+	bool writeSamples(int channel, int frame, const T* source, int count, bool capped = true){
+		bool written = true;
+		while(count > 0){
+			int span = std::min(spanAt(frame), count);
+			Page* page = writePage(frame >> CUBE_PAGE_SHIFT, capped);
+			if(page != NULL) encodeCubeSamples((const float*)source, page->encoding, page->at(channel * CUBE_PAGE_FRAMES + (frame & CUBE_PAGE_MASK)), span * Page::LANES);
+			else written = false;
+			source += span;
+			frame += span;
+			count -= span;
+		}
+		return written;
+	}
+
+	///Copies count samples of one channel starting at frame out of the cube.
+	void readSamples(int channel, int frame, T* destination, int count) const {
+		while(count > 0){
+			int span = std::min(spanAt(frame), count);
+			const Page* page = pages[frame >> CUBE_PAGE_SHIFT];
+			if(page == NULL) memset((void*)destination, 0, span * sizeof(T));
+			else decodeCubeSamples(page->at(channel * CUBE_PAGE_FRAMES + (frame & CUBE_PAGE_MASK)), page->encoding, (float*)destination, span * Page::LANES);
+			destination += span;
+			frame += span;
+			count -= span;
+		}
+	}
+
+	///Copies count interleaved frames from source into the cube starting at frame, returns false if any were dropped, see writeSamples.
+	bool writeFrames(int frame, const T* source, int count, bool capped = true){
+		T plane [64];
+		bool written = true;
+		while(count > 0){
+			int span = std::min(64, count);
+			for(int c = 0; c < CHANNELS; c++){
+				for(int fi = 0; fi < span; fi++){
+					plane[fi] = source[fi * CHANNELS + c];
+				}
+				written &= writeSamples(c, frame, plane, span, capped);
+			}
+			source += span * CHANNELS;
+			frame += span;
+			count -= span;
+		}
+		return written;
+	}
+
+	///Copies count frames starting at frame out of the cube, interleaved.
+	void readFrames(int frame, T* destination, int count) const {
+		T plane [64];
+		while(count > 0){
+			int span = std::min(64, count);
+			for(int c = 0; c < CHANNELS; c++){
+				readSamples(c, frame, plane, span);
+				for(int fi = 0; fi < span; fi++){
+					destination[fi * CHANNELS + c] = plane[fi];
+				}
+			}
+			destination += span * CHANNELS;
+			frame += span;
+			count -= span;
+		}
+	}
+
+	///Copies a whole page out of the cube as Page::bytes(encoding) bytes, a silent page reads as zeros.
+	void readEncoded(int page, int encoding, char* destination) const {
+		const Page* p = pages[page];
+		if(p == NULL) memset(destination, 0, Page::bytes(encoding));
+		else convertCubeSamples(p->data, p->encoding, destination, encoding, Page::VALUES);
+	}
+
+	///Replaces a whole page with Page::bytes(encoding) bytes from source. Heap pages keep the source encoding.
+	///Returns false if no page could be created, the page is then left as it was.
+	bool writeEncoded(int page, int encoding, const char* source){
+		copyOut(page);
+		Page*& p = pages[page];
+		if(p == NULL || !p->mapped){
+			Page* created = Page::create(encoding, false, false);
+			if(created == NULL) return false;
+			if(p != NULL) p->release();
+			p = created;
+		}
+		convertCubeSamples(source, encoding, p->data, p->encoding, Page::VALUES);
+		return true;
+	}
+
+	/**
+	 * Makes the first frames of this cube the same audio as other, the rest of the cube becomes silent.
+	 *
+	 * Shares pages when neither cube is mapped, otherwise the pages have to be copied.
+	 */
+	void shareFrom(const Cube& other, int frames){
+		int count = pageCount(frames);
+		if(mapped || other.mapped){
+			for(size_t pi = 0; pi < pages.size(); pi++){
+				if((int)pi < count && pi < other.pages.size() && other.pages[pi] != NULL) copyPage(pi, other.pages[pi]);
+				else clearPage(pi);
+			}
+			return;
+		}
+		for(size_t pi = 0; pi < pages.size(); pi++){
+			Page* page = (int)pi < count && pi < other.pages.size() ? other.pages[pi] : NULL;
+			if(page != NULL) page->retain();
+			if(pages[pi] != NULL) pages[pi]->release();
+			pages[pi] = page;
+		}
+	}
+
+	///Re-encodes a heap page that isn't in the cube's encoding, returns true if it did.
+	bool convertPage(int page){
+		Page* p = pages[page];
+		if(p == NULL || p->mapped || p->encoding == encoding) return false;
+		return makeWritable(pages[page], false);
+	}
+
+	///Silences the whole cube.
+	void clear(){
+		for(size_t pi = 0; pi < pages.size(); pi++){
+			clearPage(pi);
+		}
+	}
+
+	///Drops the heap pages wholly past the first frames, the cube stays the same size. Mapped cubes keep their pages.
+	void trim(int frames){
+		if(mapped) return;
+		for(size_t pi = pageCount(frames); pi < pages.size(); pi++){
+			clearPage(pi);
+		}
+	}
+
+	///Bytes of heap pages only this cube holds in its own encoding, which writes reuse instead of allocating.
+	size_t ownedBytes() const {
+		size_t owned = 0;
+		for(size_t pi = 0; pi < pages.size(); pi++){
+			const Page* p = pages[pi];
+			if(p != NULL && !p->mapped && p->encoding == encoding && p->refs.load(std::memory_order_relaxed) == 1) owned += Page::bytes(encoding);
+		}
+		return owned;
+	}
+
+	///Heap pages are simply dropped, mapped pages have to be zeroed.
+	void clearPage(int page){
+		if(mapped){
+			copyOut(page);
+			memset(pages[page]->data, 0, Page::bytes(pages[page]->encoding));
+			return;
+		}
+		if(pages[page] != NULL) pages[page]->release();
+		pages[page] = NULL;
+	}
+
+	void releasePages(){
+		for(size_t pi = 0; pi < pages.size(); pi++){
+			if(pages[pi] != NULL) pages[pi]->release();
+		}
+		pages.clear();
+	}
+
+	///Replaces page with a private copy in the cube's encoding, returns false and leaves page alone if no page could be created.
+	bool makeWritable(Page*& page, bool capped){
+		//Only a silent page needs a zeroed block, a copy overwrites all of it
+		Page* copy = Page::create(encoding, page == NULL, capped);
+		if(copy == NULL) return false;
+		if(page != NULL){
+			convertCubeSamples(page->data, page->encoding, copy->data, encoding, Page::VALUES);
+			page->release();
+		}
+		page = copy;
+		return true;
+	}
+
+	///Hands page to the copy being taken before it changes.
+	void copyOut(int page){
+		if(copy != NULL) copy->copyPage(*this, page);
+	}
+
+	///Writes the audio of source into page, which may be in another encoding. Returns false if no page could be created.
+	bool copyPage(int page, const Page* source){
+		Page* p = writePage(page, false);
+		if(p == NULL) return false;
+		if(source == NULL) memset(p->data, 0, Page::bytes(p->encoding));
+		else convertCubeSamples(source->data, source->encoding, p->data, p->encoding, Page::VALUES);
+		return true;
+	}
+};
+
+/**
+ * A copy of a mapped cube, taken a page at a time so the thread writing the cube never copies all of it at once.
+ *
+ * Create it off the audio thread, which allocates every page, then set it as the cube's copy and call step until it returns true.
+ * Pages the cube changes in the meantime are copied first, so the copy holds the cube as it was when it was attached.
+ */
+template <int CHANNELS, typename T = float>
+struct CubeCopy {
+	Cube<CHANNELS, T> cube;
+	std::vector<bool> copied;
+	///First page step hasn't looked at yet.
+	int next = 0;
+
+	///Allocates a copy of a cube of frames frames in encoding, the pages start silent.
+	CubeCopy(int frames, int encoding){
+		cube.encoding = encoding;
+		cube.resize(frames);
+		for(size_t pi = 0; pi < cube.pages.size(); pi++){
+			cube.writePage(pi, false);
+		}
+		copied.resize(cube.pages.size(), false);
+	}
+
+	///True if every page was created, the copy can't be taken otherwise.
+	bool allocated() const {
+		for(size_t pi = 0; pi < cube.pages.size(); pi++){
+			if(cube.pages[pi] == NULL) return false;
+		}
+		return true;
+	}
+
+	///Copies page of source unless it already was. Never allocates, the page exists.
+	void copyPage(const Cube<CHANNELS, T>& source, int page){
+		if(page >= (int)copied.size() || copied[page]) return;
+		cube.copyPage(page, page < (int)source.pages.size() ? source.pages[page] : NULL);
+		copied[page] = true;
+	}
+
+	///Copies the next page not copied yet, returns true once every page is.
+	bool step(const Cube<CHANNELS, T>& source){
+		while(next < (int)copied.size() && copied[next]) next++;
+		if(next >= (int)copied.size()) return true;
+		copyPage(source, next++);
+		return next >= (int)copied.size();
+	}
+};
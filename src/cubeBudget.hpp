@@ -0,0 +1,62 @@
+#pragma once
+
+#include <rack.hpp>
+
+/**
+ * Heap memory held by cube pages across every module in the plugin, and an optional cap on it.
+ *
+ * Pages charge the budget when they are allocated and refund it when they are freed, so shared pages count once.
+ * Memory mapped pages live in their files and aren't counted.
+ *
+ * Recording checks the cap as each page is charged and stops when a page is refused, see CubePage::create.
+ * Loading a saved patch is never refused, so loads and the copies made of them can pass the cap.
+ * Modules also check it before starting a recording, so one isn't started only to stop at once.
+ *
+ * Blocks cubePagePool holds ready count as pooled, and the pool only grows while used and pooled together stay within the limit.
+ */
+struct CubeBudget {
+
+	std::atomic<int64_t> used {0};
+
+	///Bytes in blocks cubePagePool holds ready for new pages.
+	std::atomic<int64_t> pooled {0};
+
+	///Bytes cube pages may use, 0 for no limit.
+	std::atomic<int64_t> limit {0};
+
+	void charge(int64_t bytes){
+		used.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	///Charges bytes only if they stay within the limit, returns false and charges nothing otherwise.
+	bool tryCharge(int64_t bytes){
+		int64_t cap = limit.load(std::memory_order_relaxed);
+		int64_t current = used.load(std::memory_order_relaxed);
+		do{
+			if(cap > 0 && current + bytes > cap) return false;
+		}while(!used.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+		return true;
+	}
+
+	void refund(int64_t bytes){
+		used.fetch_sub(bytes, std::memory_order_relaxed);
+	}
+
+	///Returns true if bytes more can be allocated without passing the limit.
+	bool fits(int64_t bytes) const {
+		int64_t cap = limit.load(std::memory_order_relaxed);
+		return cap <= 0 || used.load(std::memory_order_relaxed) + bytes <= cap;
+	}
+
+	///Returns true if the pool can hold bytes more without used and pooled together passing the limit.
+	bool fitsPool(int64_t bytes) const {
+		int64_t cap = limit.load(std::memory_order_relaxed);
+		return cap <= 0 || used.load(std::memory_order_relaxed) + pooled.load(std::memory_order_relaxed) + bytes <= cap;
+	}
+};
+
+///The plugin wide budget, shared by every module that stores cubes.
+inline CubeBudget& cubeBudget(){
+	static CubeBudget budget;
+	return budget;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "cube.hpp"
+
+///Values per Rice block, each block picks its own parameter.
+#define CUBE_CODEC_BLOCK 64
+///Rice parameter marking a block whose residuals are all zero.
+#define CUBE_CODEC_ZERO_BLOCK 63
+///Unary lengths from here on escape to a length prefixed raw value.
+#define CUBE_CODEC_ESCAPE 24
+
+/**
+ * Lossless codec for one cube page, used by compressed cube files.
+ *
+ * Every channel (and every voice lane of a float_4 page) is coded as its own sequence:
+ * samples are turned into integers (floats by their bit pattern, in order), predicted from the previous two, and the residuals are Rice coded in blocks.
+ *
+ * Pages are coded independently so files can be decoded one page at a time.
+ */
+struct CubeCodec {
+
+	struct BitWriter {
+		std::string& out;
+		uint64_t bits = 0;
+		int count = 0;
+
+		BitWriter(std::string& out) : out(out) {}
+
+		///Writes the low n bits of value, n <= 32.
+		void write(uint64_t value, int n){
+			if(n == 0) return;
+			bits |= (value & ((1ULL << n) - 1)) << count;
+			count += n;
+			while(count >= 8){
+				out.push_back((char)(bits & 0xff));
+				bits >>= 8;
+				count -= 8;
+			}
+		}
+
+		void writeLong(uint64_t value, int n){
+			if(n > 32){
+				write(value, 32);
+				write(value >> 32, n - 32);
+			}else{
+				write(value, n);
+			}
+		}
+
+		void flush(){
+			if(count > 0) out.push_back((char)(bits & 0xff));
+			bits = 0;
+			count = 0;
+		}
+	};
+
+	struct BitReader {
+		const uint8_t* data;
+		size_t size;
+		size_t position = 0;
+		uint64_t bits = 0;
+		int count = 0;
+		bool overrun = false;
+
+		BitReader(const char* data, size_t size) : data((const uint8_t*)data), size(size) {}
+
+		///Reads n bits, n <= 32. Reading past the end sets overrun and returns zeros.
+		uint64_t read(int n){
+			if(n == 0) return 0;
+			while(count < n){
+				if(position >= size){
+					overrun = true;
+					return 0;
+				}
+				bits |= (uint64_t)data[position++] << count;
+				count += 8;
+			}
+			uint64_t value = bits & ((1ULL << n) - 1);
+			bits >>= n;
+			count -= n;
+			return value;
+		}
+
+		uint64_t readLong(int n){
+			if(n > 32){
+				uint64_t low = read(32);
+				return low | (read(n - 32) << 32);
+			}
+			return read(n);
+		}
+	};
+
+	///Reads value i of a page as an integer that orders like the sample.
+	static int64_t toInteger(const char* page, int encoding, int i){
+		if(encoding == CUBE_INT16){
+			return ((const int16_t*)page)[i];
+		}
+		if(encoding == CUBE_INT24){
+			const uint8_t* sample = (const uint8_t*)page + i * 3;
+			uint32_t word = sample[0] | (sample[1] << 8) | (sample[2] << 16);
+			return (int32_t)(word << 8) >> 8;
+		}
+		int32_t word;
+		memcpy(&word, page + i * 4, 4);
+		//Negative floats count down as their bits count up, flipping them makes the order monotonic
+		if(word < 0) word ^= 0x7fffffff;
+		return word;
+	}
+
+	static void fromInteger(char* page, int encoding, int i, int64_t value){
+		if(encoding == CUBE_INT16){
+			((int16_t*)page)[i] = (int16_t)value;
+		}else if(encoding == CUBE_INT24){
+			uint8_t* sample = (uint8_t*)page + i * 3;
+			sample[0] = value;
+			sample[1] = value >> 8;
+			sample[2] = value >> 16;
+		}else{
+			int32_t word = (int32_t)value;
+			if(word < 0) word ^= 0x7fffffff;
+			memcpy(page + i * 4, &word, 4);
+		}
+	}
+
+	static uint64_t zigzag(int64_t value){
+		return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	}
+
+	static int64_t unzigzag(uint64_t value){
+		return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+	}
+
+	static int bitLength(uint64_t value){
+		int n = 0;
+		while(value != 0){
+			value >>= 1;
+			n++;
+		}
+		return n;
+	}
+
+	/**
+	 * Appends the first frames of every sequence of a page to out.
+	 *
+	 * channels and lanes describe the page layout, see CubePage. Frames past frames aren't written and decode as silence.
+	 */
+	static void compress(const char* page, int encoding, int channels, int lanes, int frames, std::string& out){
+		BitWriter writer(out);
+		uint64_t residuals [CUBE_CODEC_BLOCK];
+		for(int c = 0; c < channels; c++){
+			for(int l = 0; l < lanes; l++){
+				int64_t previous [2] = {0, 0};
+				for(int f = 0; f < frames; f += CUBE_CODEC_BLOCK){
+					int n = std::min(CUBE_CODEC_BLOCK, frames - f);
+					uint64_t sum = 0;
+					for(int bi = 0; bi < n; bi++){
+						int64_t value = toInteger(page, encoding, (c * CUBE_PAGE_FRAMES + f + bi) * lanes + l);
+						residuals[bi] = zigzag(value - (2 * previous[0] - previous[1]));
+						previous[1] = previous[0];
+						previous[0] = value;
+						sum += residuals[bi];
+					}
+					if(sum == 0){
+						writer.write(CUBE_CODEC_ZERO_BLOCK, 6);
+						continue;
+					}
+					//A parameter near log2 of the mean residual keeps the unary parts short
+					int k = std::max(0, bitLength(sum / n) - 1);
+					writer.write(k, 6);
+					for(int bi = 0; bi < n; bi++){
+						uint64_t q = residuals[bi] >> k;
+						if(q < CUBE_CODEC_ESCAPE){
+							writer.write((1ULL << q) - 1, q + 1);
+							writer.writeLong(residuals[bi], k);
+						}else{
+							writer.write((1ULL << CUBE_CODEC_ESCAPE) - 1, CUBE_CODEC_ESCAPE);
+							int length = bitLength(residuals[bi]);
+							writer.write(length, 7);
+							writer.writeLong(residuals[bi], length);
+						}
+					}
+				}
+			}
+		}
+		writer.flush();
+	}
+
+	///Decodes a page written by compress into page, which must already be silent. Returns false if data is corrupt.
+	static bool decompress(const char* data, size_t size, int encoding, int channels, int lanes, int frames, char* page){
+		BitReader reader(data, size);
+		for(int c = 0; c < channels; c++){
+			for(int l = 0; l < lanes; l++){
+				int64_t previous [2] = {0, 0};
+				for(int f = 0; f < frames; f += CUBE_CODEC_BLOCK){
+					int n = std::min(CUBE_CODEC_BLOCK, frames - f);
+					int k = reader.read(6);
+					for(int bi = 0; bi < n; bi++){
+						uint64_t residual = 0;
+						if(k != CUBE_CODEC_ZERO_BLOCK){
+							uint64_t q = 0;
+							while(q < CUBE_CODEC_ESCAPE && reader.read(1) == 1 && !reader.overrun) q++;
+							if(q < CUBE_CODEC_ESCAPE){
+								residual = (q << k) | reader.readLong(k);
+							}else{
+								int length = reader.read(7);
+								if(length > 64) return false;
+								residual = reader.readLong(length);
+							}
+						}
+						if(reader.overrun) return false;
+						int64_t value = unzigzag(residual) + (2 * previous[0] - previous[1]);
+						fromInteger(page, encoding, (c * CUBE_PAGE_FRAMES + f + bi) * lanes + l, value);
+						previous[1] = previous[0];
+						previous[0] = value;
+					}
+				}
+			}
+		}
+		return true;
+	}
+};
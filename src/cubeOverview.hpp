@@ -0,0 +1,191 @@
+#pragma once
+
+#include "cube.hpp"
+
+///Bins in the finest level of a CubeOverview, each level above has half as many.
+#define CUBE_OVERVIEW_BINS 2048
+#define CUBE_OVERVIEW_LEVELS 12
+
+/**
+ * Min/max peaks of a cube at every power of two zoom, for drawing its waveform without reading the audio.
+ *
+ * Level 0 holds the peaks of each run of binFrames() frames, the bins of each level above cover two bins of the level below.
+ * The bin size is picked so the whole cube fits in CUBE_OVERVIEW_BINS bins, so the storage is fixed and never reallocated.
+ *
+ * Only the thread that writes the cube updates its overview. Other threads read it lock free, a bin being updated may show a mix of old and new peaks for a frame.
+ */
+struct CubeOverview {
+
+	///Levels stored one after the other, level 0 first.
+	std::atomic<float> low [2 * CUBE_OVERVIEW_BINS];
+	std::atomic<float> high [2 * CUBE_OVERVIEW_BINS];
+
+	std::atomic<int> shift {0};
+
+	///Level 0 bin that recording is in, its parents are brought up to date when recording leaves it.
+	int recordBin = -1;
+
+	CubeOverview(){
+		clear();
+	}
+
+	static int levelOffset(int level){
+		return 2 * CUBE_OVERVIEW_BINS - (2 * CUBE_OVERVIEW_BINS >> level);
+	}
+
+	static int levelBins(int level){
+		return CUBE_OVERVIEW_BINS >> level;
+	}
+
+	int binFrames() const {
+		return 1 << shift.load(std::memory_order_relaxed);
+	}
+
+	///Picks the bin size for a cube of frames frames and clears the overview.
+	void resize(int frames){
+		int s = 0;
+		while((frames >> s) >= CUBE_OVERVIEW_BINS) s++;
+		shift = s;
+		clear();
+	}
+
+	void clear(){
+		for(int i = 0; i < 2 * CUBE_OVERVIEW_BINS; i++){
+			low[i].store(0.f, std::memory_order_relaxed);
+			high[i].store(0.f, std::memory_order_relaxed);
+		}
+		recordBin = -1;
+	}
+
+	///Copies the peaks of another overview of the same size, used when cubes share pages.
+	void copyFrom(const CubeOverview& other){
+		shift = other.shift.load(std::memory_order_relaxed);
+		for(int i = 0; i < 2 * CUBE_OVERVIEW_BINS; i++){
+			low[i].store(other.low[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			high[i].store(other.high[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+		recordBin = -1;
+	}
+
+	///Starts a new recording, the first bin it writes replaces whatever peaks were there.
+	void startRecording(){
+		finishBin();
+		recordBin = -1;
+	}
+
+	/**
+	 * Notes that recording wrote frames [frame, frame + count), with every sample between peakLow and peakHigh.
+	 *
+	 * O(1) per call, the levels above 0 are updated once per bin as recording leaves it.
+	 */
+	void record(int frame, int count, float peakLow, float peakHigh){
+		int s = shift.load(std::memory_order_relaxed);
+		int first = std::min(frame >> s, CUBE_OVERVIEW_BINS - 1);
+		int last = std::min((frame + count - 1) >> s, CUBE_OVERVIEW_BINS - 1);
+		for(int bin = first; bin <= last; bin++){
+			if(bin != recordBin){
+				//Recording overwrites the cube, so a bin it enters starts over
+				finishBin();
+				recordBin = bin;
+				low[bin].store(peakLow, std::memory_order_relaxed);
+				high[bin].store(peakHigh, std::memory_order_relaxed);
+			}else{
+				if(peakLow < low[bin].load(std::memory_order_relaxed)) low[bin].store(peakLow, std::memory_order_relaxed);
+				if(peakHigh > high[bin].load(std::memory_order_relaxed)) high[bin].store(peakHigh, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * Widens the peaks of frames [frame, frame + count), written apart from recording such as a copy into bins recording already started over.
+	 *
+	 * Leaves the bin recording is in alone, so the two can be interleaved. O(levels) per bin touched.
+	 */
+	void widen(int frame, int count, float peakLow, float peakHigh){
+		int s = shift.load(std::memory_order_relaxed);
+		int first = std::min(frame >> s, CUBE_OVERVIEW_BINS - 1);
+		int last = std::min((frame + count - 1) >> s, CUBE_OVERVIEW_BINS - 1);
+		for(int bin = first; bin <= last; bin++){
+			if(peakLow < low[bin].load(std::memory_order_relaxed)) low[bin].store(peakLow, std::memory_order_relaxed);
+			if(peakHigh > high[bin].load(std::memory_order_relaxed)) high[bin].store(peakHigh, std::memory_order_relaxed);
+			updateParents(bin);
+		}
+	}
+
+	///Brings the parents of the bin recording is in up to date.
+	void finishBin(){
+		if(recordBin < 0) return;
+		updateParents(recordBin);
+	}
+
+	///Recomputes every level above a level 0 bin from its children.
+	void updateParents(int bin){
+		for(int level = 1; level < CUBE_OVERVIEW_LEVELS; level++){
+			int child = levelOffset(level - 1) + (bin & ~1);
+			bin >>= 1;
+			int parent = levelOffset(level) + bin;
+			low[parent].store(std::min(low[child].load(std::memory_order_relaxed), low[child + 1].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+			high[parent].store(std::max(high[child].load(std::memory_order_relaxed), high[child + 1].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+		}
+	}
+
+	/**
+	 * Widens the peaks with the first frames of cube, reading its audio a page at a time.
+	 *
+	 * Used after a cube is loaded or replaced in bulk, clear the overview first to start from silence.
+	 */
+	template <int CHANNELS, typename T>
+	void include(const Cube<CHANNELS, T>& cube, int frames){
+		typedef typename Cube<CHANNELS, T>::Page Page;
+		int s = shift.load(std::memory_order_relaxed);
+		int lanes = Page::LANES;
+		std::vector<float> plane(CUBE_PAGE_FRAMES * lanes);
+		frames = std::min(frames, cube.size);
+		for(int frame = 0; frame < frames; frame += CUBE_PAGE_FRAMES){
+			if(cube.pages[frame >> CUBE_PAGE_SHIFT] == NULL) continue;
+			int span = std::min(CUBE_PAGE_FRAMES, frames - frame);
+			for(int c = 0; c < CHANNELS; c++){
+				cube.readSamples(c, frame, (T*)plane.data(), span);
+				for(int fi = 0; fi < span; fi++){
+					int bin = std::min((frame + fi) >> s, CUBE_OVERVIEW_BINS - 1);
+					float binLow = low[bin].load(std::memory_order_relaxed);
+					float binHigh = high[bin].load(std::memory_order_relaxed);
+					for(int li = 0; li < lanes; li++){
+						binLow = std::min(binLow, plane[fi * lanes + li]);
+						binHigh = std::max(binHigh, plane[fi * lanes + li]);
+					}
+					low[bin].store(binLow, std::memory_order_relaxed);
+					high[bin].store(binHigh, std::memory_order_relaxed);
+				}
+			}
+		}
+		for(int level = 1; level < CUBE_OVERVIEW_LEVELS; level++){
+			int children = levelOffset(level - 1);
+			int parents = levelOffset(level);
+			for(int bin = 0; bin < levelBins(level); bin++){
+				low[parents + bin].store(std::min(low[children + bin * 2].load(std::memory_order_relaxed), low[children + bin * 2 + 1].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+				high[parents + bin].store(std::max(high[children + bin * 2].load(std::memory_order_relaxed), high[children + bin * 2 + 1].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/**
+	 * Peaks of frames [start, end), read from the coarsest level with at least 8 bins in the range.
+	 *
+	 * The range is widened to whole bins, at most an eighth of it on each side.
+	 */
+	void peaks(int start, int end, float& peakLow, float& peakHigh) const {
+		int s = shift.load(std::memory_order_relaxed);
+		int level = 0;
+		while(level + 1 < CUBE_OVERVIEW_LEVELS && (16 << (s + level)) <= end - start) level++;
+		int first = std::min(start >> (s + level), levelBins(level) - 1);
+		int last = std::min(std::max(end - 1, start) >> (s + level), levelBins(level) - 1);
+		int offset = levelOffset(level);
+		peakLow = 0.f;
+		peakHigh = 0.f;
+		for(int bin = first; bin <= last; bin++){
+			peakLow = std::min(peakLow, low[offset + bin].load(std::memory_order_relaxed));
+			peakHigh = std::max(peakHigh, high[offset + bin].load(std::memory_order_relaxed));
+		}
+	}
+};
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <rack.hpp>
+#include "cubeBudget.hpp"
+
+#if defined ARCH_WIN
+	#include <malloc.h>
+#endif
+
+///Alignment of pool blocks and of page samples, one cache line.
+#define CUBE_PAGE_ALIGN 64
+
+///Blocks of each size the pool keeps ready to hand out.
+#define CUBE_POOL_RESERVE 16
+///The reserve of a size doubles, up to this, each refill after the audio thread found none left.
+#define CUBE_POOL_RESERVE_MAX 512
+///Different block sizes the pool can hold, one for each page encoding and sample type in use.
+#define CUBE_POOL_SIZES 8
+///A raised reserve halves, back down to CUBE_POOL_RESERVE, after this long without the audio thread finding none left.
+#define CUBE_POOL_DECAY_MS 1000
+
+/**
+ * Preallocated, aligned memory blocks for cube pages, so the audio thread never calls the allocator.
+ *
+ * Each block size has two free lists: zeroed blocks for new silent pages, and released blocks still holding old audio, for pages about to be overwritten anyway.
+ * A background thread zeroes released blocks, allocates more when a size runs low and frees what it holds past twice the reserve.
+ * It sleeps until acquire or release signal work, and only wakes on a timer while a raised reserve is decaying.
+ *
+ * The blocks held are counted as cubeBudget().pooled, and the pool never grows past the budget's limit.
+ *
+ * acquire and release hold a spin lock for a few pointer updates only. On the audio thread (see realtime) an empty pool returns NULL instead of allocating.
+ */
+struct CubePagePool {
+
+	///A free block, the link lives in the block's own memory.
+	struct Block {
+		Block* next;
+	};
+
+	struct FreeList {
+		size_t bytes = 0;
+		Block* zeroed = NULL;
+		Block* dirty = NULL;
+		int zeroedCount = 0;
+		int dirtyCount = 0;
+		int reserve = 0;
+		//Set when the audio thread found the lists empty
+		bool missed = false;
+	};
+
+	FreeList lists [CUBE_POOL_SIZES];
+	std::atomic_flag lock = ATOMIC_FLAG_INIT;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+	//Set by signal, cleared by the refill thread as it starts a pass
+	std::atomic<bool> signalled {false};
+
+	CubePagePool(){
+		//Constructed first so it outlives the pool, whose destructor still counts into it
+		cubeBudget();
+	}
+
+	~CubePagePool(){
+		{
+			std::unique_lock<std::mutex> guard(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		if(thread.joinable()) thread.join();
+		for(int li = 0; li < CUBE_POOL_SIZES; li++){
+			while(Block* block = pop(lists[li].zeroed, lists[li].zeroedCount)) freeBlock(block, lists[li].bytes);
+			while(Block* block = pop(lists[li].dirty, lists[li].dirtyCount)) freeBlock(block, lists[li].bytes);
+		}
+	}
+
+	///True on threads that must never allocate, set by the modules at the start of process().
+	static bool& realtime(){
+		static thread_local bool flag = false;
+		return flag;
+	}
+
+	/**
+	 * Keeps blocks of bytes ready from now on and fills the reserve before returning.
+	 *
+	 * Call off the audio thread for every block size the audio thread will ask for, sizes it asks for unannounced are only ready a few milliseconds later.
+	 */
+	void reserve(size_t bytes){
+		{
+			std::unique_lock<std::mutex> guard(mutex);
+			if(!thread.joinable()) thread = std::thread(&CubePagePool::run, this);
+		}
+		lockLists();
+		listFor(bytes);
+		unlockLists();
+		refill(false);
+	}
+
+	///Returns a block of bytes, zeroed if asked, or NULL if none is ready on the audio thread or the allocator fails.
+	void* acquire(size_t bytes, bool zero){
+		lockLists();
+		FreeList* list = listFor(bytes);
+		Block* block = NULL;
+		bool clean = false;
+		bool low = false;
+		if(list != NULL){
+			if(zero || list->dirty == NULL){
+				block = pop(list->zeroed, list->zeroedCount);
+				clean = block != NULL;
+			}
+			if(block == NULL) block = pop(list->dirty, list->dirtyCount);
+			if(block == NULL && realtime()) list->missed = true;
+			low = list->zeroedCount < list->reserve;
+		}
+		unlockLists();
+		if(block != NULL) cubeBudget().pooled.fetch_sub(bytes, std::memory_order_relaxed);
+		if(low) signal();
+
+		if(block == NULL && !realtime()) block = allocateBlock(bytes);
+		if(block == NULL) return NULL;
+		if(zero && !clean) memset((void*)block, 0, bytes);
+		return block;
+	}
+
+	///Takes back a block from acquire, it is zeroed or freed later on the refill thread.
+	void release(void* memory, size_t bytes){
+		lockLists();
+		FreeList* list = listFor(bytes);
+		if(list != NULL){
+			push(list->dirty, list->dirtyCount, (Block*)memory);
+			memory = NULL;
+		}
+		unlockLists();
+		//Only when every size is taken, which no module does
+		if(memory != NULL){
+			freeBlock((Block*)memory, 0);
+			return;
+		}
+		cubeBudget().pooled.fetch_add(bytes, std::memory_order_relaxed);
+		signal();
+	}
+
+	/**
+	 * Wakes the refill thread, once until it starts its next pass.
+	 *
+	 * The audio thread can't wait for the mutex, so it only notifies when the mutex is free.
+	 * If the refill thread is just about to sleep the wake up is lost, the next acquire or release signals again.
+	 */
+	void signal(){
+		if(signalled.exchange(true)) return;
+		if(realtime()){
+			if(!mutex.try_lock()){
+				//Let the next signal try again
+				signalled = false;
+				return;
+			}
+			mutex.unlock();
+		}else{
+			std::unique_lock<std::mutex> guard(mutex);
+		}
+		wakeup.notify_one();
+	}
+
+	void run(){
+		std::unique_lock<std::mutex> guard(mutex);
+		while(!stopping){
+			bool woken = true;
+			if(raised()){
+				woken = wakeup.wait_for(guard, std::chrono::milliseconds(CUBE_POOL_DECAY_MS), [this]{ return stopping || signalled; });
+			}else{
+				wakeup.wait(guard, [this]{ return stopping || signalled; });
+			}
+			if(stopping) return;
+			signalled = false;
+			guard.unlock();
+			//Lower raised reserves only after a whole period without work
+			refill(!woken);
+			guard.lock();
+		}
+	}
+
+	///True while any reserve is above CUBE_POOL_RESERVE, so the refill thread has to wake to lower it.
+	bool raised(){
+		lockLists();
+		bool raised = false;
+		for(int li = 0; li < CUBE_POOL_SIZES; li++){
+			if(lists[li].reserve > CUBE_POOL_RESERVE) raised = true;
+		}
+		unlockLists();
+		return raised;
+	}
+
+	/**
+	 * Zeroes released blocks and allocates or frees blocks until every size holds between its reserve and twice it.
+	 *
+	 * A reserve doubles after a miss, and halves when decay is set and there was none. New blocks are only allocated while cubeBudget() has room for them.
+	 */
+	void refill(bool decay){
+		for(int li = 0; li < CUBE_POOL_SIZES; li++){
+			FreeList& list = lists[li];
+			lockLists();
+			size_t bytes = list.bytes;
+			if(list.missed) list.reserve = std::min(list.reserve * 2, CUBE_POOL_RESERVE_MAX);
+			else if(decay) list.reserve = std::max(list.reserve / 2, CUBE_POOL_RESERVE);
+			list.missed = false;
+			unlockLists();
+			if(bytes == 0) continue;
+
+			while(true){
+				lockLists();
+				Block* block = NULL;
+				int total = list.zeroedCount + list.dirtyCount;
+				bool trim = total > list.reserve * 2;
+				if(trim) block = list.dirty != NULL ? pop(list.dirty, list.dirtyCount) : pop(list.zeroed, list.zeroedCount);
+				else if(list.zeroedCount < list.reserve) block = pop(list.dirty, list.dirtyCount);
+				bool grow = !trim && block == NULL && list.zeroedCount < list.reserve;
+				unlockLists();
+
+				if(trim){
+					freeBlock(block, bytes);
+					continue;
+				}
+				if(grow && cubeBudget().fitsPool(bytes)){
+					block = allocateBlock(bytes);
+					if(block != NULL) cubeBudget().pooled.fetch_add(bytes, std::memory_order_relaxed);
+				}
+				if(block == NULL) break;
+				memset((void*)block, 0, bytes);
+				lockLists();
+				push(list.zeroed, list.zeroedCount, block);
+				unlockLists();
+			}
+		}
+	}
+
+	void lockLists(){
+		while(lock.test_and_set(std::memory_order_acquire)){}
+	}
+
+	void unlockLists(){
+		lock.clear(std::memory_order_release);
+	}
+
+	///The free lists of a block size, set up on first use. Call with the lists locked.
+	FreeList* listFor(size_t bytes){
+		for(int li = 0; li < CUBE_POOL_SIZES; li++){
+			if(lists[li].bytes == bytes) return &lists[li];
+			if(lists[li].bytes == 0){
+				lists[li].bytes = bytes;
+				lists[li].reserve = CUBE_POOL_RESERVE;
+				return &lists[li];
+			}
+		}
+		return NULL;
+	}
+
+	static Block* pop(Block*& head, int& count){
+		Block* block = head;
+		if(block == NULL) return NULL;
+		head = block->next;
+		count--;
+		return block;
+	}
+
+	static void push(Block*& head, int& count, Block* block){
+		block->next = head;
+		head = block;
+		count++;
+	}
+
+	static Block* allocateBlock(size_t bytes){
+#if defined ARCH_WIN
+		return (Block*)_aligned_malloc(bytes, CUBE_PAGE_ALIGN);
+#else
+		void* aligned = NULL;
+		if(posix_memalign(&aligned, CUBE_PAGE_ALIGN, bytes) != 0) return NULL;
+		return (Block*)aligned;
+#endif
+	}
+
+	///Frees a block, taking pooledBytes off cubeBudget().pooled for blocks still counted there.
+	static void freeBlock(Block* block, size_t pooledBytes){
+		if(pooledBytes > 0) cubeBudget().pooled.fetch_sub(pooledBytes, std::memory_order_relaxed);
+#if defined ARCH_WIN
+		_aligned_free(block);
+#else
+		free(block);
+#endif
+	}
+};
+
+///The plugin wide pool, shared by every module that stores cubes.
+inline CubePagePool& cubePagePool(){
+	static CubePagePool pool;
+	return pool;
+}
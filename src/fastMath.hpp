@@ -0,0 +1,86 @@
+#pragma once
+
+#include <rack.hpp>
+
+/**
+ * Polynomial replacements for the libm trig calls in per sample loops.
+ *
+ * Every function is a template that works on float and on simd::float_4, without branches,
+ * so a float_4 call costs the same as a float call and lanes never diverge.
+ * Error bounds hold for both forms, measured against double precision libm.
+ * They only differ when x falls exactly halfway between quadrants, where float rounds away from zero and float_4 to even.
+ */
+
+/**
+ * Sine and cosine of x, within 1.1e-7 of the exact values for |x| up to 1000.
+ *
+ * x is reduced to r in [-pi/4, pi/4] by the nearest multiple of pi/2, with pi/2 split in three so the reduction is exact to float precision.
+ * Minimax polynomials of r then give both results, the quadrant picks which one is which and their signs.
+ */
+template <typename T>
+inline void fastSinCos(T x, T& sine, T& cosine){
+	T quadrant = rack::simd::round(x * T(0.636619772f));
+	T r = x - quadrant * T(1.5703125f);
+	r -= quadrant * T(4.83826792e-4f);
+	r -= quadrant * T(2.56328292e-12f);
+	T r2 = r * r;
+	T s = r + r * r2 * (T(-1.6666654611e-1f) + r2 * (T(8.3321608736e-3f) + r2 * T(-1.9515295891e-4f)));
+	T c = T(1.f) - T(0.5f) * r2 + r2 * r2 * (T(4.166664568298827e-2f) + r2 * (T(-1.388731625493765e-3f) + r2 * T(2.443315711809948e-5f)));
+
+	//Quadrant 0 to 3, odd quadrants swap sine and cosine
+	T k = quadrant - T(4.f) * rack::simd::floor(quadrant * T(0.25f));
+	T odd = k - T(2.f) * rack::simd::floor(k * T(0.5f));
+	T swappedSine = rack::simd::ifelse(odd > T(0.5f), c, s);
+	T swappedCosine = rack::simd::ifelse(odd > T(0.5f), s, c);
+	sine = rack::simd::ifelse(k > T(1.5f), -swappedSine, swappedSine);
+	cosine = rack::simd::ifelse(rack::simd::fabs(k - T(1.5f)) < T(1.f), -swappedCosine, swappedCosine);
+}
+
+template <typename T>
+inline T fastSin(T x){
+	T sine, cosine;
+	fastSinCos(x, sine, cosine);
+	return sine;
+}
+
+template <typename T>
+inline T fastCos(T x){
+	T sine, cosine;
+	fastSinCos(x, sine, cosine);
+	return cosine;
+}
+
+///Polynomial atan2, within 2e-6 radians of atan2().
+template <typename T>
+inline T fastAtan2(T y, T x){
+	T ax = rack::simd::fabs(x);
+	T ay = rack::simd::fabs(y);
+	T a = rack::simd::fmin(ax, ay) / (rack::simd::fmax(ax, ay) + T(1e-30f));
+	T s = a * a;
+	T r = ((((T(-0.01172120f) * s + T(0.05265332f)) * s - T(0.11643287f)) * s + T(0.19354346f)) * s - T(0.33262347f)) * s * a + T(0.99997726f) * a;
+	r = rack::simd::ifelse(ay > ax, T(M_PI_2) - r, r);
+	r = rack::simd::ifelse(x < T(0.f), T(M_PI) - r, r);
+	return rack::simd::ifelse(y < T(0.f), -r, r);
+}
+
+/**
+ * Wraps an angle into [0, 2pi].
+ *
+ * Angles already in range are returned as they are, so 2pi doesn't become 0.
+ */
+template <typename T>
+inline T wrapAngle(T angle){
+	T wrapped = angle - T(2.0f * M_PI) * rack::simd::floor(angle * T(0.5f / M_PI));
+	return rack::simd::ifelse(angle > T(2.0f * M_PI), wrapped, rack::simd::ifelse(angle < T(0.f), wrapped, angle));
+}
+
+/**
+ * Wraps an angle difference into [-pi, pi], give or take a rounding error.
+ *
+ * Angles already in range are returned as they are, so pi and -pi keep their sign.
+ */
+template <typename T>
+inline T wrapAngleDelta(T angle){
+	T wrapped = angle - T(2.0f * M_PI) * rack::simd::round(angle * T(0.5f / M_PI));
+	return rack::simd::ifelse(rack::simd::fabs(angle) > T(M_PI), wrapped, angle);
+}
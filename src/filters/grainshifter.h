@@ -0,0 +1,174 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+
+//Stereo time domain pitch shifter, two overlapping grains read from a delay line at the shifted rate
+//Much cheaper than the phase vocoder and delays by at most a grain, at the cost of some roughness
+//Each grain restarts while the other is at full level, at the delay where the two line up best (WSOLA style), so they cross fade in phase
+//At no shift both grains settle on no delay, and the input passes through unchanged
+//T is float, or simd::float_4 to shift four voices with the same grain timing at once
+template <typename T>
+struct GrainShifter {
+	static const int CHANNELS = 2;
+	static const int WINDOW_SIZE = 1024;
+	//Delays a restarting grain can be moved on by to find its splice point, about 1.5ms at 44.1khz
+	static const int SEARCH_SIZE = 64;
+	//Samples compared for each delay tried
+	static const int CORRELATION_SIZE = 32;
+
+	T *delayLine [CHANNELS] = {};
+	float window [WINDOW_SIZE + 1];
+	long delaySize = 0;
+	long delayMask = 0;
+	long writeIndex = 0;
+	float grainSize = 0.f;
+	float grainPhase = 0.f;
+	//Delay of each grain in samples, grain 0 restarts as grainPhase wraps and grain 1 as it passes 0.5
+	float grainDelay [2] = {};
+
+	GrainShifter() {
+		//sin^2 window, two grains half a grain apart always sum to 1
+		for (int i = 0; i <= WINDOW_SIZE; i++) {
+			float s = sinf(M_PI * i / WINDOW_SIZE);
+			window[i] = s * s;
+		}
+	}
+
+	void init(float grainSeconds, float sampleRate) {
+		cleanup();
+		grainSize = floorf(grainSeconds * sampleRate);
+		delaySize = 1;
+		while (delaySize < maxDelay() + CORRELATION_SIZE + 2) delaySize <<= 1;
+		delayMask = delaySize - 1;
+		for (int c = 0; c < CHANNELS; c++) {
+			delayLine[c] = new T[delaySize]();
+		}
+		writeIndex = 0;
+		grainPhase = 0.f;
+		grainDelay[0] = grainDelay[1] = 0.f;
+	}
+
+	void cleanup() {
+		for (int c = 0; c < CHANNELS; c++) {
+			delete[] delayLine[c];
+			delayLine[c] = NULL;
+		}
+	}
+
+	~GrainShifter() {
+		cleanup();
+	}
+
+	void reset() {
+		if (delayLine[0] == NULL)
+			return;
+		for (int c = 0; c < CHANNELS; c++) {
+			std::fill(delayLine[c], delayLine[c] + delaySize, T(0.f));
+		}
+		grainPhase = 0.f;
+		grainDelay[0] = grainDelay[1] = 0.f;
+	}
+
+	float maxDelay() {
+		return grainSize + SEARCH_SIZE;
+	}
+
+	float windowAt(float phase) {
+		float pos = phase * WINDOW_SIZE;
+		int i = (int)pos;
+		return window[i] + (window[i+1] - window[i]) * (pos - i);
+	}
+
+	T readAt(int c, float delay) {
+		float pos = writeIndex - delay;
+		long i = (long)floorf(pos);
+		float frac = pos - i;
+		T a = delayLine[c][i & delayMask];
+		T b = delayLine[c][(i + 1) & delayMask];
+		return a + (b - a) * frac;
+	}
+
+	//Sum of the lanes of a float or simd::float_4
+	template <typename V>
+	static float laneSum(const V& v) {
+		const float* lanes = (const float*)&v;
+		float sum = 0.f;
+		for (int li = 0; li < (int)(sizeof(V) / sizeof(float)); li++) sum += lanes[li];
+		return sum;
+	}
+
+	//Delay a grain restarts at, the one of SEARCH_SIZE delays from start whose last CORRELATION_SIZE samples best match the other grain's
+	//Both grains then drift at the same rate, so they stay lined up for the whole cross fade
+	//Channels (and the voices of a float_4) are matched together, so they keep the same grain timing
+	float spliceDelay(float start, float otherDelay) {
+		//Same fraction as the other grain, so a perfect match reads exactly the same samples
+		float fraction = otherDelay - floorf(otherDelay);
+		long first = writeIndex - (long)floorf(start);
+		long other = writeIndex - (long)floorf(otherDelay);
+		int best = 0;
+		float bestScore = -INFINITY;
+		for (int k = 0; k < SEARCH_SIZE; k++) {
+			T sum = T(0.f);
+			for (int c = 0; c < CHANNELS; c++) {
+				for (int j = 0; j < CORRELATION_SIZE; j++) {
+					sum += delayLine[c][(first - k - j) & delayMask] * delayLine[c][(other - j) & delayMask];
+				}
+			}
+			float score = laneSum(sum);
+			if (score > bestScore) {
+				bestScore = score;
+				best = k;
+			}
+		}
+		return floorf(start) + best + fraction;
+	}
+
+	//Starts grain g over while it is silent
+	void restartGrain(int g, float drift, float life) {
+		//No shift, go straight to no delay rather than lining up with a delayed grain
+		if (drift == 0.f) {
+			grainDelay[g] = 0.f;
+			return;
+		}
+		//Start where the grain will drift across the delays it needs in its life without going below 0
+		float start = drift < 0.f ? fminf(-drift * life, grainSize) : 0.f;
+		grainDelay[g] = spliceDelay(start, grainDelay[1 - g]);
+	}
+
+	//Streams one stereo sample through the shifter
+	void process(const float pitchShift, const T *input, T *output) {
+		for (int c = 0; c < CHANNELS; c++) {
+			delayLine[c][writeIndex] = input[c];
+		}
+
+		//The delay of each grain drifts at 1 - pitchShift samples per sample
+		//Grains last a grain at shifts near 1, and less at larger shifts so the drift stays within a grain
+		//They keep cycling with no shift, so delays left over from an earlier shift are dropped within a grain
+		float drift = 1.f - pitchShift;
+		float life = grainSize / fmaxf(fabsf(drift), 1.f);
+		float previous = grainPhase;
+		grainPhase += fminf(1.f / life, 0.25f);
+		bool wrapped = grainPhase >= 1.f;
+		if (wrapped) grainPhase -= 1.f;
+		if (wrapped) restartGrain(0, drift, life);
+		if (previous < 0.5f && grainPhase >= 0.5f) restartGrain(1, drift, life);
+
+		for (int g = 0; g < 2; g++) {
+			grainDelay[g] = fminf(fmaxf(grainDelay[g] + drift, 0.f), maxDelay());
+		}
+
+		//Each grain fades out as it reaches its restart, while the other grain is at full level
+		float gainA = windowAt(grainPhase);
+		float gainB = 1.f - gainA;
+		for (int c = 0; c < CHANNELS; c++) {
+			if (grainDelay[0] == grainDelay[1]) {
+				output[c] = readAt(c, grainDelay[0]);
+			} else {
+				output[c] = readAt(c, grainDelay[0]) * gainA + readAt(c, grainDelay[1]) * gainB;
+			}
+		}
+
+		writeIndex = (writeIndex + 1) & delayMask;
+	}
+};
@@ -7,28 +7,38 @@ License: GNU GPL-3.0
 #include <string.h>
 #include <math.h>
 #include <stdio.h>
+#include <rack.hpp>
 #include "../pffft/pffft.h"
+#include "../fastMath.hpp"
 
 using namespace std;
 
+//Stereo phase vocoder pitch shifter, single precision with the per bin work done four bins at a time
+//Both channels share one hop schedule and go through each stage of a frame together
 struct PitchShifter {
-	float *gInFIFO;
-	float *gOutFIFO;
-	float *gFFTworksp;
-	float *gFFTworkspOut;
-	float *gLastPhase;
-	float *gSumPhase;
-	float *gOutputAccum;
-	float *gAnaFreq;
-	float *gAnaMagn;
-	float *gSynFreq;
-	float *gSynMagn;
+	typedef rack::simd::float_4 float_4;
+
+	static const int CHANNELS = 2;
+
+	float *gInFIFO [CHANNELS];
+	float *gOutFIFO [CHANNELS];
+	float *gOutputAccum [CHANNELS];
+	float *gLastPhase [CHANNELS];
+	float *gSumPhase [CHANNELS];
+	float *gAnaFreq [CHANNELS];
+	float *gAnaMagn [CHANNELS];
+	float *gSynFreq [CHANNELS];
+	float *gSynMagn [CHANNELS];
+	float *gFFTworksp [CHANNELS];
+	float *gFFTworkspOut [CHANNELS];
+	float *gFFTwork;
+	float *gAnaWindow;
+	float *gSynWindow;
 	float sampleRate;
 	PFFFT_Setup *pffftSetup = NULL;
 	long gRover = false;
-	double magn, phase, tmp, window, real, imag;
-	double freqPerBin, expct, invOsamp, invFftFrameSize, invFftFrameSize2, invPi;
-	long fftFrameSize, osamp, i,k, qpd, index, inFifoLatency, stepSize, fftFrameSize2;
+	float freqPerBin, expct, freqScale, phaseScale;
+	long fftFrameSize, osamp, i,k, index, inFifoLatency, stepSize, fftFrameSize2;
 
 	PitchShifter() {
 
@@ -43,128 +53,175 @@ struct PitchShifter {
 
 		fftFrameSize2 = fftFrameSize/2;
 		stepSize = fftFrameSize/osamp;
-		freqPerBin = sampleRate/(double)fftFrameSize;
-		expct = 2.0f * M_PI * (double)stepSize/(double)fftFrameSize;
+		freqPerBin = sampleRate/(float)fftFrameSize;
+		expct = 2.0f * M_PI * (float)stepSize/(float)fftFrameSize;
 		inFifoLatency = fftFrameSize-stepSize;
-		invOsamp = 1.0f/osamp;
-		invFftFrameSize = 1.0f/fftFrameSize;
-		invFftFrameSize2 = 1.0f/fftFrameSize2;
-		invPi = 1.0f/M_PI;
-
-		gInFIFO = new float[fftFrameSize] {0.f};
-		gOutFIFO =  new float[fftFrameSize] {0.f};
-		gFFTworksp = (float*)pffft_aligned_malloc(fftFrameSize*sizeof(float));
-		gFFTworkspOut =  (float*)pffft_aligned_malloc(fftFrameSize*sizeof(float));
-		gLastPhase = new float[fftFrameSize2+1] {0.f};
-		gSumPhase = new float[fftFrameSize2+1] {0.f};
-		gOutputAccum = new float[2*fftFrameSize] {0.f};
-		gAnaFreq = new float[fftFrameSize] {0.f};
-		gAnaMagn = new float[fftFrameSize] {0.f};
-		gSynFreq = new float[fftFrameSize] {0.f};
-		gSynMagn = new float[fftFrameSize] {0.f};
+		//Converts a wrapped phase deviation to a fraction of a bin
+		freqScale = osamp * 0.5f / M_PI;
+		//Converts a frequency to the phase it advances by in one hop
+		phaseScale = 2.0f * M_PI / (osamp * freqPerBin);
+
+		for (int c = 0; c < CHANNELS; c++) {
+			gInFIFO[c] = allocate(fftFrameSize);
+			gOutFIFO[c] = allocate(fftFrameSize);
+			gOutputAccum[c] = allocate(2*fftFrameSize);
+			gLastPhase[c] = allocate(fftFrameSize2);
+			gSumPhase[c] = allocate(fftFrameSize2);
+			gAnaFreq[c] = allocate(fftFrameSize2);
+			gAnaMagn[c] = allocate(fftFrameSize2);
+			gSynFreq[c] = allocate(fftFrameSize2);
+			gSynMagn[c] = allocate(fftFrameSize2);
+			gFFTworksp[c] = allocate(fftFrameSize);
+			gFFTworkspOut[c] = allocate(fftFrameSize);
+		}
+		gFFTwork = allocate(fftFrameSize);
+
+		//Hann window, the synthesis table also carries the overlap-add gain
+		gAnaWindow = allocate(fftFrameSize);
+		gSynWindow = allocate(fftFrameSize);
+		for (k = 0; k < fftFrameSize; k++) {
+			gAnaWindow[k] = -0.5 * cos(2.0 * M_PI * (double)k / fftFrameSize) + 0.5;
+			gSynWindow[k] = 2.0f * gAnaWindow[k] / (fftFrameSize2 * osamp);
+		}
+	}
+
+	static float* allocate(long size) {
+		float* data = (float*)pffft_aligned_malloc(size*sizeof(float));
+		memset(data, 0, size*sizeof(float));
+		return data;
 	}
 
 	void cleanup() {
 		if (pffftSetup == NULL)
 			return;
 		pffft_destroy_setup(pffftSetup);
-		delete[] gInFIFO;
-		delete[] gOutFIFO;
-		delete[] gLastPhase;
-		delete[] gSumPhase;
-		delete[] gOutputAccum;
-		delete[] gAnaFreq;
-		delete[] gAnaMagn;
-		delete[] gSynFreq;
-		delete[] gSynMagn;
-		pffft_aligned_free(gFFTworksp);
-		pffft_aligned_free(gFFTworkspOut);
+		pffftSetup = NULL;
+		for (int c = 0; c < CHANNELS; c++) {
+			float *buffers[] = {gInFIFO[c], gOutFIFO[c], gOutputAccum[c], gLastPhase[c], gSumPhase[c], gAnaFreq[c], gAnaMagn[c], gSynFreq[c], gSynMagn[c], gFFTworksp[c], gFFTworkspOut[c]};
+			for (float *buffer : buffers) pffft_aligned_free(buffer);
+		}
+		float *buffers[] = {gFFTwork, gAnaWindow, gSynWindow};
+		for (float *buffer : buffers) pffft_aligned_free(buffer);
 	}
 
 	~PitchShifter() {
 		cleanup();
 	}
 
+	//Clears the FIFOs and phase state, the next gInFIFO fill starts from silence
+	void reset() {
+		if (pffftSetup == NULL)
+			return;
+		gRover = inFifoLatency;
+		for (int c = 0; c < CHANNELS; c++) {
+			memset(gInFIFO[c], 0, fftFrameSize*sizeof(float));
+			memset(gOutFIFO[c], 0, fftFrameSize*sizeof(float));
+			memset(gOutputAccum[c], 0, 2*fftFrameSize*sizeof(float));
+			memset(gLastPhase[c], 0, fftFrameSize2*sizeof(float));
+			memset(gSumPhase[c], 0, fftFrameSize2*sizeof(float));
+		}
+	}
+
+	//Streams one stereo sample through the shifter, a frame is analysed and resynthesised once every stepSize samples
+	//Output is delayed by inFifoLatency samples
 	void process(const float pitchShift, const float *input, float *output) {
+		for (int c = 0; c < CHANNELS; c++) {
+			gInFIFO[c][gRover] = input[c];
+			output[c] = gRover >= inFifoLatency ? gOutFIFO[c][gRover-inFifoLatency] : 0.0f;
+		}
+
+		gRover++;
+
+		if (gRover >= fftFrameSize) {
+			gRover = inFifoLatency;
+			processFrame(pitchShift);
+		}
+	}
+
+	//Stores the magnitude and true frequency of four bins of channel c, starting at bin k
+	void analyse(int c, float_4 bin) {
+		//Bins are interleaved real/imaginary, split them into four reals and four imaginaries
+		float_4 lo = float_4::load(gFFTworkspOut[c] + 2*k);
+		float_4 hi = float_4::load(gFFTworkspOut[c] + 2*k + 4);
+		float_4 real = float_4(_mm_shuffle_ps(lo.v, hi.v, _MM_SHUFFLE(2, 0, 2, 0)));
+		float_4 imag = float_4(_mm_shuffle_ps(lo.v, hi.v, _MM_SHUFFLE(3, 1, 3, 1)));
+
+		float_4 magn = 2.f * rack::simd::sqrt(real*real + imag*imag);
+		float_4 phase = fastAtan2(imag, real);
+		float_4 delta = phase - float_4::load(gLastPhase[c] + k);
+		phase.store(gLastPhase[c] + k);
+		delta = wrapAngleDelta(delta - bin * expct);
+
+		magn.store(gAnaMagn[c] + k);
+		((bin + delta * freqScale) * freqPerBin).store(gAnaFreq[c] + k);
+	}
+
+	//Moves every analysed bin of channel c to the bin pitchShift times higher
+	void shiftBins(int c, const float pitchShift) {
+		memset(gSynMagn[c], 0, fftFrameSize2*sizeof(float));
+		memset(gSynFreq[c], 0, fftFrameSize2*sizeof(float));
 
-			for (i = 0; i < fftFrameSize; i++) {
-				gInFIFO[gRover] = input[i];
-
-				if(gRover >= inFifoLatency)  // [bsp] 09Mar2019: this fixes the noise burst issue in REI
-					 output[i] = gOutFIFO[gRover-inFifoLatency];
-				else
-					 output[i] = 0.0f;
-
-				gRover++;
-
-				if (gRover >= fftFrameSize) {
-					gRover = inFifoLatency;
-
-					memset(gFFTworksp, 0, fftFrameSize*sizeof(float));
-					memset(gFFTworkspOut, 0, fftFrameSize*sizeof(float));
-
-					for (k = 0; k < fftFrameSize;k++) {
-						window = -0.5 * cos(2.0f * M_PI * (double)k * invFftFrameSize) + 0.5f;
-						gFFTworksp[k] = gInFIFO[k] * window;
-					}
-
-					pffft_transform_ordered(pffftSetup, gFFTworksp, gFFTworkspOut, NULL, PFFFT_FORWARD);
-
-					for (k = 0; k < fftFrameSize2; k++) {
-						real = gFFTworkspOut[2*k];
-						imag = gFFTworkspOut[2*k+1];
-						magn = 2.*sqrt(real*real + imag*imag);
-						phase = atan2(imag,real);
-						tmp = phase - gLastPhase[k];
-						gLastPhase[k] = phase;
-						tmp -= (double)k*expct;
-						qpd = tmp * invPi;
-						if (qpd >= 0) qpd += qpd&1;
-						else qpd -= qpd&1;
-						tmp -= M_PI*(double)qpd;
-						tmp = osamp * tmp * invPi * 0.5f;
-						tmp = (double)k*freqPerBin + tmp*freqPerBin;
-						gAnaMagn[k] = magn;
-						gAnaFreq[k] = tmp;
-					}
-
-					memset(gSynMagn, 0, fftFrameSize*sizeof(float));
-					memset(gSynFreq, 0, fftFrameSize*sizeof(float));
-
-					for (k = 0; k < fftFrameSize2; k++) {
-						index = k*pitchShift;
-						if (index < fftFrameSize2) {
-							gSynMagn[index] += gAnaMagn[k];
-							gSynFreq[index] = gAnaFreq[k] * pitchShift;
-						}
-					}
-
-					memset(gFFTworksp, 0, fftFrameSize*sizeof(float));
-					memset(gFFTworkspOut, 0, fftFrameSize*sizeof(float));
-
-					for (k = 0; k < fftFrameSize2; k++) {
-						magn = k==0 ? 0 : gSynMagn[k];
-						tmp = gSynFreq[k];
-						tmp -= (double)k*freqPerBin;
-						tmp /= freqPerBin;
-						tmp = 2.0f * M_PI * tmp * invOsamp;
-						tmp += (double)k*expct;
-						gSumPhase[k] += tmp;
-						phase = gSumPhase[k];
-						gFFTworksp[2*k] = magn*cos(phase);
-						gFFTworksp[2*k+1] = magn*sin(phase);
-					}
-
-					pffft_transform_ordered(pffftSetup, gFFTworksp, gFFTworkspOut , NULL, PFFFT_BACKWARD);
-					for(k=0; k < fftFrameSize; k++) {
-						window = -0.5f * cos(2.0f * M_PI *(double)k * invFftFrameSize) + 0.5f;
-						gOutputAccum[k] += 2.0f * window * gFFTworkspOut[k] * invFftFrameSize2 * invOsamp;
-					}
-
-					for (k = 0; k < stepSize; k++) gOutFIFO[k] = gOutputAccum[k];
-					memmove(gOutputAccum, gOutputAccum+stepSize, fftFrameSize*sizeof(float));
-					for (k = 0; k < inFifoLatency; k++) gInFIFO[k] = gInFIFO[k+stepSize];
-				}
+		for (k = 0; k < fftFrameSize2; k++) {
+			index = k*pitchShift;
+			if (index < fftFrameSize2) {
+				gSynMagn[c][index] += gAnaMagn[c][k];
+				gSynFreq[c][index] = gAnaFreq[c][k] * pitchShift;
 			}
+		}
+		gSynMagn[c][0] = 0.f;
+	}
+
+	//Writes four bins of channel c starting at bin k, each advanced by its frequency over one hop
+	//The phase is kept wrapped so the sin/cos approximations stay accurate
+	void synthesise(int c) {
+		float_4 magn = float_4::load(gSynMagn[c] + k);
+		float_4 phase = wrapAngleDelta(float_4::load(gSumPhase[c] + k) + float_4::load(gSynFreq[c] + k) * phaseScale);
+		phase.store(gSumPhase[c] + k);
+
+		float_4 real = magn * rack::simd::cos(phase);
+		float_4 imag = magn * rack::simd::sin(phase);
+		float_4(_mm_unpacklo_ps(real.v, imag.v)).store(gFFTworksp[c] + 2*k);
+		float_4(_mm_unpackhi_ps(real.v, imag.v)).store(gFFTworksp[c] + 2*k + 4);
+	}
+
+	//Analyses the last fftFrameSize input samples and adds the shifted frame to the output, emitting one hop
+	void processFrame(const float pitchShift) {
+		for (k = 0; k < fftFrameSize; k += 4) {
+			float_4 window = float_4::load(gAnaWindow + k);
+			(float_4::load(gInFIFO[0] + k) * window).store(gFFTworksp[0] + k);
+			(float_4::load(gInFIFO[1] + k) * window).store(gFFTworksp[1] + k);
+		}
+
+		pffft_transform_ordered(pffftSetup, gFFTworksp[0], gFFTworkspOut[0], gFFTwork, PFFFT_FORWARD);
+		pffft_transform_ordered(pffftSetup, gFFTworksp[1], gFFTworkspOut[1], gFFTwork, PFFFT_FORWARD);
+
+		float_4 bin = float_4(0.f, 1.f, 2.f, 3.f);
+		for (k = 0; k < fftFrameSize2; k += 4, bin += 4.f) {
+			analyse(0, bin);
+			analyse(1, bin);
+		}
+
+		shiftBins(0, pitchShift);
+		shiftBins(1, pitchShift);
+
+		for (k = 0; k < fftFrameSize2; k += 4) {
+			synthesise(0);
+			synthesise(1);
+		}
+
+		pffft_transform_ordered(pffftSetup, gFFTworksp[0], gFFTworkspOut[0], gFFTwork, PFFFT_BACKWARD);
+		pffft_transform_ordered(pffftSetup, gFFTworksp[1], gFFTworkspOut[1], gFFTwork, PFFFT_BACKWARD);
+
+		for (k = 0; k < fftFrameSize; k += 4) {
+			float_4 window = float_4::load(gSynWindow + k);
+			(float_4::load(gOutputAccum[0] + k) + window * float_4::load(gFFTworkspOut[0] + k)).store(gOutputAccum[0] + k);
+			(float_4::load(gOutputAccum[1] + k) + window * float_4::load(gFFTworkspOut[1] + k)).store(gOutputAccum[1] + k);
+		}
+
+		for (int c = 0; c < CHANNELS; c++) {
+			memcpy(gOutFIFO[c], gOutputAccum[c], stepSize*sizeof(float));
+			memmove(gOutputAccum[c], gOutputAccum[c]+stepSize, fftFrameSize*sizeof(float));
+			memmove(gInFIFO[c], gInFIFO[c]+stepSize, inFifoLatency*sizeof(float));
+		}
 	}
 };
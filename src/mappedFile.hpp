@@ -0,0 +1,127 @@
+#pragma once
+
+#include <rack.hpp>
+
+#if defined ARCH_WIN
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+/**
+ * A file mapped read/write into memory.
+ *
+ * Pages are only read from disk when they are first touched, and writes go to the OS page cache which writes them back to the file on its own schedule.
+ *
+ * The file is grown (zero filled) or truncated to the requested size when it is opened.
+ */
+struct MappedFile {
+
+	///Start of the mapped file, NULL when nothing is mapped.
+	char* data = NULL;
+
+	///Size of the mapping in bytes.
+	size_t size = 0;
+
+#if defined ARCH_WIN
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = NULL;
+#else
+	int fd = -1;
+#endif
+
+	MappedFile(){}
+
+	~MappedFile(){
+		close();
+	}
+
+	/**
+	 * Opens (creating if needed) the file at path, resizes it to size bytes and maps all of it.
+	 *
+	 * Returns false if any step fails, in which case nothing is left mapped.
+	 */
+	bool open(const std::string& path, size_t size){
+		close();
+#if defined ARCH_WIN
+		std::wstring pathW = rack::string::UTF8toUTF16(path);
+		fileHandle = CreateFileW(pathW.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(fileHandle == INVALID_HANDLE_VALUE){
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		fileSize.QuadPart = size;
+		if(!SetFilePointerEx(fileHandle, fileSize, NULL, FILE_BEGIN) || !SetEndOfFile(fileHandle)){
+			close();
+			return false;
+		}
+		mappingHandle = CreateFileMappingW(fileHandle, NULL, PAGE_READWRITE, fileSize.HighPart, fileSize.LowPart, NULL);
+		if(mappingHandle == NULL){
+			close();
+			return false;
+		}
+		data = (char*)MapViewOfFile(mappingHandle, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		if(data == NULL){
+			close();
+			return false;
+		}
+#else
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if(fd < 0){
+			return false;
+		}
+		if(ftruncate(fd, size) != 0){
+			close();
+			return false;
+		}
+		void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(mapped == MAP_FAILED){
+			close();
+			return false;
+		}
+		data = (char*)mapped;
+#endif
+		this->size = size;
+		return true;
+	}
+
+	///Asks the OS to start writing changed pages back to disk without waiting for it to finish.
+	void flush(){
+		if(data == NULL) return;
+#if defined ARCH_WIN
+		FlushViewOfFile(data, 0);
+#else
+		msync(data, size, MS_ASYNC);
+#endif
+	}
+
+	///Unmaps and closes the file. Changes already written to the mapping are kept in the file.
+	void close(){
+#if defined ARCH_WIN
+		if(data != NULL) UnmapViewOfFile(data);
+		if(mappingHandle != NULL) CloseHandle(mappingHandle);
+		if(fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+		mappingHandle = NULL;
+		fileHandle = INVALID_HANDLE_VALUE;
+#else
+		if(data != NULL) munmap(data, size);
+		if(fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		data = NULL;
+		size = 0;
+	}
+
+	bool isOpen(){
+		return data != NULL;
+	}
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <rack.hpp>
+
+///Most cubes a read pattern can order.
+#define READ_PATTERN_CUBES_MAX 32
+///Orders of up to this many cubes take microseconds to rank, so they are ranked on the audio thread.
+#define READ_PATTERN_SYNC_CUBES 6
+
+///Number of negative read patterns for count cubes.
+inline int negativeReadPatternRows(int count){
+	return (count - 2) * count + 1;
+}
+
+/**
+ * Longest jump, in cubes, of step `step` of negative read pattern `row`.
+ *
+ * Row r spreads r extra cubes of jump as evenly as it can over the count steps,
+ * so row 0 always moves on by one cube and the last row always jumps count - 1 cubes.
+ */
+inline int negativeReadPatternJump(int count, int row, int step){
+	step = std::max(step, 0) % count;
+	//Integer ceil((step + 1) * row / count) - ceil(step * row / count)
+	return 1 + ((step + 1) * row + count - 1) / count - (step * row + count - 1) / count;
+}
+
+///Doubles in each scratch table ReadPatternOrders::rankOrder needs for count cubes.
+constexpr int readPatternTableSize(int count){
+	return count * ((count - 1) * (count - 1) / 2 + 1);
+}
+
+/**
+ * Orders in which positive read patterns visit the cubes.
+ *
+ * Every order starts on cube 1 and visits the others once each. They are ranked from in turn (1, 2, 3, ... 0) outwards,
+ * by how far the cubes are moved from their place in turn in total (Spearman's footrule), ties in lexicographic order.
+ * With six cubes that gives the 120 hand written orders of earlier versions, in the same order.
+ *
+ * The order of a rank is found without listing the orders before it, by counting the orders with each prefix.
+ * Up to READ_PATTERN_SYNC_CUBES cubes that is done on the audio thread. Larger counts can take a few hundred milliseconds,
+ * so they are ranked on a background thread and the last order ready is used until the new one is.
+ */
+struct ReadPatternOrders {
+
+	//Orders ranked on the audio thread
+	int syncOrder [READ_PATTERN_SYNC_CUBES] = {};
+	uint64_t syncKey = 0;
+	double syncTables [3][readPatternTableSize(READ_PATTERN_SYNC_CUBES)];
+
+	//Orders ranked on the background thread, asyncKey names the order in asyncOrder
+	std::atomic<int> asyncOrder [READ_PATTERN_CUBES_MAX];
+	std::atomic<uint64_t> asyncKey {0};
+	//Last key handed to the thread, only used by the audio thread
+	uint64_t requestedKey = 0;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable requested;
+	//Key of the next order to rank, 0 for none, guarded by mutex
+	uint64_t pending = 0;
+	bool stopping = false;
+
+	ReadPatternOrders(){
+		for(int i = 0; i < READ_PATTERN_CUBES_MAX; i++) asyncOrder[i].store(0, std::memory_order_relaxed);
+	}
+
+	~ReadPatternOrders(){
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		requested.notify_all();
+		if(thread.joinable()) thread.join();
+	}
+
+	///Starts the background thread if orders of count cubes need it. Call from any thread but the audio thread.
+	void reserve(int count){
+		std::unique_lock<std::mutex> lock(mutex);
+		if(count > READ_PATTERN_SYNC_CUBES && !thread.joinable()) thread = std::thread(&ReadPatternOrders::run, this);
+	}
+
+	/**
+	 * Cube (0 based) visited at step `step` of the order picked by fraction, from 0 for the first order to 1 for the last.
+	 *
+	 * Never blocks, an order not ranked yet asks the background thread for it.
+	 */
+	int cube(int count, float fraction, int step){
+		uint64_t key = makeKey(count, fraction);
+		if(count <= READ_PATTERN_SYNC_CUBES){
+			if(key != syncKey){
+				rankOrder(count, fraction, syncOrder, syncTables[0], syncTables[1], syncTables[2]);
+				syncKey = key;
+			}
+			return syncOrder[step];
+		}
+
+		uint64_t ready = asyncKey.load(std::memory_order_acquire);
+		if(key != ready && key != requestedKey){
+			//Tried again on the next call if the thread holds the lock
+			std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+			if(lock.owns_lock()){
+				pending = key;
+				requestedKey = key;
+				lock.unlock();
+				requested.notify_one();
+			}
+		}
+		//Until an order of this many cubes is ready, visit them in turn
+		int visit = asyncOrder[step].load(std::memory_order_relaxed);
+		if((int)(ready >> 32) != count || visit >= count) return (step + 1) % count;
+		return visit;
+	}
+
+	static uint64_t makeKey(int count, float fraction){
+		uint32_t bits;
+		memcpy(&bits, &fraction, sizeof bits);
+		return ((uint64_t)count << 32) | bits;
+	}
+
+	void run(){
+		std::vector<double> tables [3];
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true){
+			requested.wait(lock, [this]{ return stopping || pending != 0; });
+			if(stopping) return;
+			uint64_t key = pending;
+			pending = 0;
+			lock.unlock();
+
+			int count = key >> 32;
+			uint32_t bits = key;
+			float fraction;
+			memcpy(&fraction, &bits, sizeof fraction);
+			for(int t = 0; t < 3; t++) tables[t].resize(readPatternTableSize(count));
+			int order [READ_PATTERN_CUBES_MAX];
+			rankOrder(count, fraction, order, tables[0].data(), tables[1].data(), tables[2].data());
+			for(int i = 0; i < count; i++) asyncOrder[i].store(order[i], std::memory_order_relaxed);
+			asyncKey.store(key, std::memory_order_release);
+
+			lock.lock();
+		}
+	}
+
+	/**
+	 * Counts the ways to finish a permutation of 1..m whose first k places are filled, with the values marked in used,
+	 * so that the displacement of the remaining places adds up to exactly target.
+	 *
+	 * Works gap by gap: the displacement of the remaining places is the number of times they cross the gaps between b and b + 1,
+	 * and past k that only depends on how many places and values are still unmatched. dp and next hold (m + 1) * (target + 1) doubles.
+	 */
+	static double countCompletions(int m, int k, const bool* used, int target, double* dp, double* next){
+		if(target < 0) return 0;
+		if(k == m) return target == 0 ? 1 : 0;
+
+		//Places up to k are filled, each of their gaps is crossed by one later place for every value up to it still free
+		int crossed = 0;
+		int freeValues = 0;
+		for(int b = 1; b <= k; b++){
+			if(!used[b]) freeValues++;
+			crossed += freeValues;
+		}
+		if(crossed > target) return 0;
+		int left = target - crossed;
+
+		int width = left + 1;
+		int size = (m + 1) * width;
+		std::fill(dp, dp + size, 0.0);
+		dp[0] = 1;
+		//Unmatched values minus unmatched places, which is the same whatever the places were matched to
+		int surplus = freeValues;
+		for(int t = k + 1; t <= m; t++){
+			std::fill(next, next + size, 0.0);
+			bool freeValue = !used[t];
+			int nextSurplus = surplus + (freeValue ? 1 : 0) - 1;
+			for(int places = 0; places <= m; places++){
+				int values = places + surplus;
+				if(values < 0) continue;
+				for(int d = 0; d <= left; d++){
+					double ways = dp[places * width + d];
+					if(ways == 0) continue;
+					//Place t and (if free) value t are matched among themselves or to open ones, or left open
+					auto step = [&](int nextPlaces, double weight){
+						int nextValues = nextPlaces + nextSurplus;
+						if(nextPlaces < 0 || nextPlaces > m || nextValues < 0) return;
+						int nd = d + (t < m ? nextPlaces + nextValues : 0);
+						if(nd > left) return;
+						next[nextPlaces * width + nd] += ways * weight;
+					};
+					if(!freeValue){
+						if(values > 0) step(places, values);
+						step(places + 1, 1);
+					}else{
+						step(places, 1);
+						if(values > 0 && places > 0) step(places - 1, (double)values * places);
+						if(values > 0) step(places, values);
+						if(places > 0) step(places, places);
+						step(places + 1, 1);
+					}
+				}
+			}
+			surplus = nextSurplus;
+			std::swap(dp, next);
+		}
+		return dp[left];
+	}
+
+	/**
+	 * Fills order with the cubes visited by the order picked by fraction, see cube.
+	 *
+	 * Each scratch table holds readPatternTableSize(count) doubles. Ranks are counted in doubles,
+	 * so past about 18 cubes neighbouring fractions can land on orders a few ranks apart.
+	 */
+	static void rankOrder(int count, float fraction, int* order, double* levels, double* dp, double* next){
+		//Cube 1 always comes first, the rest are a permutation of 1..m, value v standing for cube v + 1
+		int m = count - 1;
+		bool used [READ_PATTERN_CUBES_MAX + 1] = {};
+		int maxDisplacement = m * m / 2;
+		double total = 0;
+		for(int f = 0; f <= maxDisplacement; f++){
+			levels[f] = countCompletions(m, 0, used, f, dp, next);
+			total += levels[f];
+		}
+		double rank = std::floor(clamp(fraction, 0.f, 1.f) * (total - 1) + 0.5);
+
+		//Find the displacement of the order, then each value in turn
+		int displacement = 0;
+		while(displacement < maxDisplacement && rank >= levels[displacement]){
+			rank -= levels[displacement];
+			displacement++;
+		}
+		order[0] = 1 % count;
+		int sum = 0;
+		for(int k = 1; k <= m; k++){
+			int last = -1;
+			for(int v = 1; v <= m; v++){
+				if(used[v]) continue;
+				int moved = sum + std::abs(v - k);
+				if(moved > displacement) continue;
+				last = v;
+				used[v] = true;
+				double ways = countCompletions(m, k, used, displacement - moved, dp, next);
+				if(rank < ways){
+					sum = moved;
+					break;
+				}
+				rank -= ways;
+				used[v] = false;
+				last = -1;
+			}
+			//Rounding in the counts of very large orders can run off the end, take the last value that fit
+			if(last < 0){
+				for(int v = m; v >= 1; v--){
+					if(!used[v]){
+						last = v;
+						used[v] = true;
+						sum += std::abs(v - k);
+						break;
+					}
+				}
+			}
+			order[k] = (last + 1) % count;
+		}
+	}
+};
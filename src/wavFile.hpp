@@ -0,0 +1,215 @@
+#pragma once
+
+#include <rack.hpp>
+#include <fstream>
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+///Bytes before the audio in files written by WavWriter: RIFF header, an 18 byte fmt chunk, a fact chunk and the data chunk header.
+#define WAV_WRITER_HEADER_SIZE 58
+
+/**
+ * Writes a 32-bit float WAV file a block of frames at a time.
+ *
+ * The header is written with placeholder sizes when the file is opened and patched by close, so the length doesn't need to be known up front.
+ */
+struct WavWriter {
+
+	std::ofstream file;
+	int channels = 0;
+	uint32_t frames = 0;
+
+	static void put16(char* p, uint16_t value){
+		p[0] = value;
+		p[1] = value >> 8;
+	}
+
+	static void put32(char* p, uint32_t value){
+		for(int i = 0; i < 4; i++) p[i] = value >> (i * 8);
+	}
+
+	///Creates (or truncates) the file at path. Returns false if it can't be written.
+	bool open(const std::string& path, int channels, int sampleRate){
+		this->channels = channels;
+		frames = 0;
+		file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		if(!file.is_open()) return false;
+
+		char header [WAV_WRITER_HEADER_SIZE] = {};
+		memcpy(header, "RIFF", 4);
+		memcpy(header + 8, "WAVE", 4);
+		memcpy(header + 12, "fmt ", 4);
+		put32(header + 16, 18);
+		put16(header + 20, WAV_FORMAT_FLOAT);
+		put16(header + 22, channels);
+		put32(header + 24, sampleRate);
+		put32(header + 28, sampleRate * channels * sizeof(float));
+		put16(header + 32, channels * sizeof(float));
+		put16(header + 34, 32);
+		//cbSize at 36 stays 0
+		memcpy(header + 38, "fact", 4);
+		put32(header + 42, 4);
+		memcpy(header + 50, "data", 4);
+		file.write(header, sizeof header);
+		return file.good();
+	}
+
+	///Appends count interleaved frames.
+	bool write(const float* samples, int count){
+		if(count <= 0) return true;
+		//WAV is little endian, as is every platform Rack runs on
+		file.write((const char*)samples, (size_t)count * channels * sizeof(float));
+		frames += count;
+		return file.good();
+	}
+
+	///Fills in the sizes and closes the file. Returns false if anything failed to write.
+	bool close(){
+		uint32_t dataBytes = frames * channels * sizeof(float);
+		char size [4];
+		put32(size, WAV_WRITER_HEADER_SIZE - 8 + dataBytes);
+		file.seekp(4);
+		file.write(size, 4);
+		put32(size, frames);
+		file.seekp(46);
+		file.write(size, 4);
+		put32(size, dataBytes);
+		file.seekp(54);
+		file.write(size, 4);
+		bool ok = file.good();
+		file.close();
+		return ok;
+	}
+};
+
+/**
+ * Reads the audio of a WAV file a block of frames at a time, as floats from -1 to 1.
+ *
+ * Handles 8, 16, 24 and 32-bit integer PCM and 32 or 64-bit float, including WAVE_FORMAT_EXTENSIBLE files.
+ */
+struct WavReader {
+
+	std::ifstream file;
+	int channels = 0;
+	int sampleRate = 0;
+	int format = 0;
+	int bitsPerSample = 0;
+	int frameBytes = 0;
+
+	///Frames in the data chunk.
+	uint32_t frames = 0;
+	uint32_t framesLeft = 0;
+
+	std::vector<char> raw;
+
+	static uint16_t get16(const char* p){
+		return (uint8_t)p[0] | ((uint8_t)p[1] << 8);
+	}
+
+	static uint32_t get32(const char* p){
+		return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16);
+	}
+
+	///Opens path and finds its audio. Returns false if it isn't a WAV file this can read.
+	bool open(const std::string& path){
+		file.open(path, std::ios::in | std::ios::binary);
+		if(!file.is_open()) return false;
+
+		char riff [12];
+		file.read(riff, sizeof riff);
+		if(!file.good() || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) return false;
+
+		bool haveFormat = false;
+		uint32_t dataBytes = 0;
+		while(true){
+			char chunk [8];
+			file.read(chunk, sizeof chunk);
+			if(!file.good()) return false;
+			uint32_t size = get32(chunk + 4);
+
+			if(memcmp(chunk, "fmt ", 4) == 0){
+				if(size < 16 || size > 64) return false;
+				char fmt [64];
+				file.read(fmt, size);
+				if(!file.good()) return false;
+				format = get16(fmt);
+				channels = get16(fmt + 2);
+				sampleRate = get32(fmt + 4);
+				bitsPerSample = get16(fmt + 14);
+				//The real format of an extensible file is the first two bytes of its sub format GUID
+				if(format == WAV_FORMAT_EXTENSIBLE){
+					if(size < 40) return false;
+					format = get16(fmt + 24);
+				}
+				haveFormat = true;
+			}else if(memcmp(chunk, "data", 4) == 0){
+				if(!haveFormat) return false;
+				dataBytes = size;
+				break;
+			}else{
+				file.seekg(size, std::ios::cur);
+			}
+			//Chunks are padded to an even size
+			if(size & 1) file.seekg(1, std::ios::cur);
+		}
+
+		bool pcm = format == WAV_FORMAT_PCM && (bitsPerSample == 8 || bitsPerSample == 16 || bitsPerSample == 24 || bitsPerSample == 32);
+		bool ieee = format == WAV_FORMAT_FLOAT && (bitsPerSample == 32 || bitsPerSample == 64);
+		if(!pcm && !ieee) return false;
+		if(channels < 1 || sampleRate < 1) return false;
+
+		frameBytes = channels * bitsPerSample / 8;
+		//Streamed files are sometimes left with a 0 or 0xffffffff data size, read those to the end of the file
+		std::streampos start = file.tellg();
+		file.seekg(0, std::ios::end);
+		uint32_t remaining = (uint32_t)std::min<std::streamoff>(file.tellg() - start, UINT32_MAX);
+		file.seekg(start);
+		if(dataBytes == 0 || dataBytes > remaining) dataBytes = remaining;
+
+		frames = dataBytes / frameBytes;
+		framesLeft = frames;
+		return file.good();
+	}
+
+	/**
+	 * Reads up to count frames into samples, interleaved with channels floats per frame.
+	 *
+	 * Returns the number of frames read, 0 at the end of the audio and -1 if the file can't be read.
+	 */
+	int read(float* samples, int count){
+		count = std::min<uint32_t>(count, framesLeft);
+		if(count <= 0) return 0;
+		raw.resize((size_t)count * frameBytes);
+		file.read(raw.data(), raw.size());
+		if(!file.good()) return -1;
+		framesLeft -= count;
+
+		int values = count * channels;
+		const char* p = raw.data();
+		if(format == WAV_FORMAT_FLOAT && bitsPerSample == 32){
+			memcpy(samples, p, values * sizeof(float));
+		}else if(format == WAV_FORMAT_FLOAT){
+			for(int i = 0; i < values; i++){
+				double value;
+				memcpy(&value, p + i * 8, 8);
+				samples[i] = value;
+			}
+		}else if(bitsPerSample == 8){
+			//8-bit WAV is the only unsigned format
+			for(int i = 0; i < values; i++) samples[i] = ((uint8_t)p[i] - 128) / 128.f;
+		}else if(bitsPerSample == 16){
+			for(int i = 0; i < values; i++) samples[i] = (int16_t)get16(p + i * 2) / 32768.f;
+		}else if(bitsPerSample == 24){
+			for(int i = 0; i < values; i++){
+				const char* sample = p + i * 3;
+				uint32_t word = (uint8_t)sample[0] | ((uint8_t)sample[1] << 8) | ((uint8_t)sample[2] << 16);
+				samples[i] = ((int32_t)(word << 8) >> 8) / 8388608.f;
+			}
+		}else{
+			for(int i = 0; i < values; i++) samples[i] = (int32_t)get32(p + i * 4) / 2147483648.f;
+		}
+		return count;
+	}
+};
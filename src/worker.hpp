@@ -0,0 +1,71 @@
+#pragma once
+
+#include <rack.hpp>
+#include <deque>
+
+/**
+ * Runs jobs one at a time, in the order they were pushed, on a background thread.
+ *
+ * Intended for slow work like file I/O that should never run on the UI or audio thread.
+ *
+ * The thread is started by the first push and is joined when the Worker is destroyed, after any queued jobs have finished.
+ */
+struct Worker {
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable jobAdded;
+	std::condition_variable jobsDone;
+	std::deque<std::function<void()>> jobs;
+	bool busy = false;
+	bool stopping = false;
+
+	Worker(){}
+
+	~Worker(){
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		jobAdded.notify_all();
+		if(thread.joinable()) thread.join();
+	}
+
+	///Queues a job to run on the worker thread.
+	void push(std::function<void()> job){
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			jobs.push_back(job);
+			if(!thread.joinable()) thread = std::thread(&Worker::run, this);
+		}
+		jobAdded.notify_one();
+	}
+
+	///Blocks until every queued job has finished.
+	void wait(){
+		std::unique_lock<std::mutex> lock(mutex);
+		jobsDone.wait(lock, [this]{ return jobs.empty() && !busy; });
+	}
+
+	///Returns true if a job is queued or running.
+	bool isBusy(){
+		std::unique_lock<std::mutex> lock(mutex);
+		return busy || !jobs.empty();
+	}
+
+	void run(){
+		std::unique_lock<std::mutex> lock(mutex);
+		while(true){
+			jobAdded.wait(lock, [this]{ return stopping || !jobs.empty(); });
+			if(jobs.empty()) return;
+			std::function<void()> job = jobs.front();
+			jobs.pop_front();
+			busy = true;
+			lock.unlock();
+			job();
+			lock.lock();
+			busy = false;
+			if(jobs.empty()) jobsDone.notify_all();
+		}
+	}
+};
@@ -0,0 +1,60 @@
+//Checks that the time domain pitch shifter passes audio through unchanged once the shift is back to none
+//Built and run by `make test`, needs nothing but the header
+
+#include "filters/grainshifter.h"
+#include <stdio.h>
+
+#define SAMPLE_RATE 44100.f
+#define GRAIN_SECONDS 0.015f
+
+static float sine(long i){
+	return 5.f * sinf(2.f * M_PI * 441.f * i / SAMPLE_RATE);
+}
+
+//Runs count samples of the sine through shifter at shift, returns the largest difference between output and input
+static float run(GrainShifter<float>& shifter, long& i, float shift, long count){
+	float maxError = 0.f;
+	for(long end = i + count; i < end; i++){
+		float input [2] = {sine(i), -sine(i)};
+		float output [2];
+		shifter.process(shift, input, output);
+		for(int c = 0; c < 2; c++){
+			if(!isfinite(output[c])) return INFINITY;
+			maxError = fmaxf(maxError, fabsf(output[c] - input[c]));
+		}
+	}
+	return maxError;
+}
+
+int main(){
+	GrainShifter<float> shifter;
+	shifter.init(GRAIN_SECONDS, SAMPLE_RATE);
+	long grain = (long)(GRAIN_SECONDS * SAMPLE_RATE);
+	long i = 0;
+	int failed = 0;
+
+	float error = run(shifter, i, 1.f, grain * 4);
+	printf("no shift: max error %g\n", error);
+	if(error > 1e-6f) failed++;
+
+	//Shift up and down, then back to none, the output has to settle back to the input within two grains
+	const float shifts [] = {2.f, 0.5f, 6.f / 5.f, 11.f, 1.f / 11.f};
+	for(float shift : shifts){
+		error = run(shifter, i, shift, grain * 10);
+		if(!isfinite(error)){
+			printf("shift %g: output isn't finite\n", shift);
+			failed++;
+		}
+		run(shifter, i, 1.f, grain * 2);
+		error = run(shifter, i, 1.f, grain * 4);
+		printf("back from shift %g: max error %g\n", shift, error);
+		if(error > 1e-6f) failed++;
+	}
+
+	if(failed){
+		printf("FAILED %i checks\n", failed);
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}